@@ -8,6 +8,24 @@ drop function if exists dds_count;
 drop function if exists dds_total;
 drop function if exists dds_json;
 drop function if exists dds_invalid;
+drop function if exists dds_quantiles;
+drop function if exists dds_sum_quantiles;
+drop function if exists dds_build;
+drop function if exists dds_collapse;
+drop function if exists dds_convert;
+drop function if exists dds_convert_gamma;
+drop function if exists dds_stats;
+drop function if exists dds_stats_reset;
+drop function if exists dds_sum_quantile;
+drop function if exists dds_json_compact;
+drop function if exists dds_from_json;
+drop function if exists dds_add;
+drop function if exists dds_from_values;
+drop function if exists dds_add_values;
+drop function if exists dds_rank;
+drop function if exists dds_fraction_between;
+drop function if exists dds_exceeds;
+drop function if exists dds_sum_convert;
 
 create function dds_inspect returns string soname 'dds.so';
 create function dds_quantile returns real soname 'dds.so';
@@ -18,3 +36,21 @@ create function dds_count returns integer soname 'dds.so';
 create function dds_total returns real soname 'dds.so';
 create function dds_json returns string soname 'dds.so';
 create function dds_invalid returns integer soname 'dds.so';
+create function dds_quantiles returns string soname 'dds.so';
+create aggregate function dds_sum_quantiles returns string soname 'dds.so';
+create aggregate function dds_build returns string soname 'dds.so';
+create function dds_collapse returns string soname 'dds.so';
+create function dds_convert returns string soname 'dds.so';
+create function dds_convert_gamma returns string soname 'dds.so';
+create function dds_stats returns string soname 'dds.so';
+create function dds_stats_reset returns integer soname 'dds.so';
+create aggregate function dds_sum_quantile returns real soname 'dds.so';
+create function dds_json_compact returns string soname 'dds.so';
+create function dds_from_json returns string soname 'dds.so';
+create function dds_add returns string soname 'dds.so';
+create function dds_from_values returns string soname 'dds.so';
+create function dds_add_values returns string soname 'dds.so';
+create function dds_rank returns real soname 'dds.so';
+create function dds_fraction_between returns real soname 'dds.so';
+create function dds_exceeds returns integer soname 'dds.so';
+create aggregate function dds_sum_convert returns string soname 'dds.so';
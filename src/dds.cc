@@ -1,12 +1,262 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cfloat>
 #include <cmath>
+#include <chrono>
+#include <cstddef>
 #include <cstring>
-#include <sstream>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "mysql.h"
 #include "dds.h"
 
+// USDT tracepoints for perf and bpftrace, where systemtap's sdt.h is available
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DDS_PROBE1(name, a) DTRACE_PROBE1(dds, name, a)
+#define DDS_PROBE2(name, a, b) DTRACE_PROBE2(dds, name, a, b)
+#else
+#define DDS_PROBE1(name, a)
+#define DDS_PROBE2(name, a, b)
+#endif
+
+// Adds the time until it goes out of scope to a Stats counter, for one in
+// Stats::TIME_SAMPLE_PERIOD timers
+struct StatsTimer {
+    Stats::Counter counter;
+    bool sampled = Stats::SampleTime();
+    std::chrono::steady_clock::time_point start = sampled ? std::chrono::steady_clock::now()
+                                                          : std::chrono::steady_clock::time_point();
+
+    ~StatsTimer() {
+        if (!sampled) return;
+
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        Stats::Add(counter, ns * Stats::TIME_SAMPLE_PERIOD);
+    }
+};
+
+// Counts a serialized sketch of length bytes that was decoded (and merged),
+// or a failure to do so, and passes decoded through
+static bool CountDecoded(size_t length, bool decoded, unsigned long long buckets_merged = 0) {
+    if (!decoded) {
+        Stats::Add(Stats::DECODE_FAILURES, 1);
+        return false;
+    }
+
+    Stats::Add(Stats::SKETCHES_DECODED, 1);
+    Stats::Add(Stats::BYTES_DECODED, length);
+    Stats::Add(Stats::BUCKETS_MERGED, buckets_merged);
+    return true;
+}
+
+static void AddCountsScalar(unsigned long long *out, const unsigned long long *in, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] += in[i];
+    }
+}
+
+static void CumulativeCountsScalar(const Bucket *buckets, size_t n, unsigned long long *out) {
+    unsigned long long cuml_count = 0;
+    for (size_t i = 0; i < n; i++) {
+        cuml_count += buckets[i].count;
+        out[i] = cuml_count;
+    }
+}
+
+static size_t FindRankScalar(const unsigned long long *counts, size_t n, unsigned long long &cumulative,
+                             unsigned long long rank) {
+    for (size_t i = 0; i < n; i++) {
+        cumulative += counts[i];
+        if (cumulative >= rank) return i;
+    }
+    return n;
+}
+
+/*
+ * The vector kernels are compiled with target attributes rather than -m
+ * flags, so the rest of the library still runs on any x86-64 CPU.
+ *
+ * cumulative_counts loads whole buckets and picks out the counts, then
+ * prefix sums them in registers by adding shifted copies. The running total
+ * only depends on the previous one through an add, so blocks overlap. With
+ * two counts per register that doesn't pay for picking them out, so SSE4.2
+ * uses the scalar loop, which measured faster (see dds_bench). find_rank sums
+ * blocks of counts and only scans a block one count at a time once it
+ * reaches the rank.
+ */
+#if defined(__x86_64__)
+static_assert(sizeof(Bucket) == 16 && offsetof(Bucket, count) == 8, "Kernels load two counts per 32 bytes");
+
+__attribute__((target("sse4.2")))
+static void AddCountsSSE42(unsigned long long *out, const unsigned long long *in, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        auto *o = reinterpret_cast<__m128i *>(out + i);
+        auto x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        _mm_storeu_si128(o, _mm_add_epi64(_mm_loadu_si128(o), x));
+    }
+    AddCountsScalar(out + i, in + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+static size_t FindRankSSE42(const unsigned long long *counts, size_t n, unsigned long long &cumulative,
+                            unsigned long long rank) {
+    auto *in = reinterpret_cast<const __m128i *>(counts);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8, in += 4) {
+        auto x = _mm_add_epi64(_mm_add_epi64(_mm_loadu_si128(in), _mm_loadu_si128(in + 1)),
+                               _mm_add_epi64(_mm_loadu_si128(in + 2), _mm_loadu_si128(in + 3)));
+        auto sum = (unsigned long long) _mm_cvtsi128_si64(_mm_add_epi64(x, _mm_unpackhi_epi64(x, x)));
+        if (cumulative + sum >= rank) break;
+        cumulative += sum;
+    }
+    return i + FindRankScalar(counts + i, n - i, cumulative, rank);
+}
+
+__attribute__((target("avx2")))
+static void AddCountsAVX2(unsigned long long *out, const unsigned long long *in, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto *o = reinterpret_cast<__m256i *>(out + i);
+        auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+        _mm256_storeu_si256(o, _mm256_add_epi64(_mm256_loadu_si256(o), x));
+    }
+    AddCountsScalar(out + i, in + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void CumulativeCountsAVX2(const Bucket *buckets, size_t n, unsigned long long *out) {
+    __m256i carry = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        // [c0, c2, c1, c3] from two buckets per register, then in order
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buckets + i));
+        auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buckets + i + 2));
+        auto x = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+
+        // Shifted up by one count, then by two
+        x = _mm256_add_epi64(x, _mm256_alignr_epi8(x, _mm256_permute2x128_si256(x, x, 0x08), 8));
+        x = _mm256_add_epi64(x, _mm256_permute2x128_si256(x, x, 0x08));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_add_epi64(x, carry));
+        carry = _mm256_add_epi64(carry, _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3)));
+    }
+
+    unsigned long long cuml_count = i ? out[i - 1] : 0;
+    for (; i < n; i++) {
+        cuml_count += buckets[i].count;
+        out[i] = cuml_count;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t FindRankAVX2(const unsigned long long *counts, size_t n, unsigned long long &cumulative,
+                           unsigned long long rank) {
+    auto *in = reinterpret_cast<const __m256i *>(counts);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16, in += 4) {
+        auto x = _mm256_add_epi64(_mm256_add_epi64(_mm256_loadu_si256(in), _mm256_loadu_si256(in + 1)),
+                                  _mm256_add_epi64(_mm256_loadu_si256(in + 2), _mm256_loadu_si256(in + 3)));
+        auto y = _mm_add_epi64(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+        auto sum = (unsigned long long) _mm_cvtsi128_si64(_mm_add_epi64(y, _mm_unpackhi_epi64(y, y)));
+        if (cumulative + sum >= rank) break;
+        cumulative += sum;
+    }
+    return i + FindRankScalar(counts + i, n - i, cumulative, rank);
+}
+
+__attribute__((target("avx512f")))
+static void AddCountsAVX512(unsigned long long *out, const unsigned long long *in, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_si512(out + i, _mm512_add_epi64(_mm512_loadu_si512(out + i), _mm512_loadu_si512(in + i)));
+    }
+    AddCountsScalar(out + i, in + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void CumulativeCountsAVX512(const Bucket *buckets, size_t n, unsigned long long *out) {
+    const __m512i count_lanes = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+    const __m512i last_lane = _mm512_set1_epi64(7);
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i carry = zero;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto x = _mm512_permutex2var_epi64(_mm512_loadu_si512(buckets + i), count_lanes,
+                                           _mm512_loadu_si512(buckets + i + 4));
+
+        // Shifted up by one count, then by two and by four. The zero masked
+        // forms here and below avoid GCC's uninitialized warnings about the
+        // plain ones.
+        x = _mm512_add_epi64(x, _mm512_maskz_alignr_epi64(0xFF, x, zero, 7));
+        x = _mm512_add_epi64(x, _mm512_maskz_alignr_epi64(0xFF, x, zero, 6));
+        x = _mm512_add_epi64(x, _mm512_maskz_alignr_epi64(0xFF, x, zero, 4));
+        _mm512_storeu_si512(out + i, _mm512_add_epi64(x, carry));
+        carry = _mm512_add_epi64(carry, _mm512_maskz_permutexvar_epi64(0xFF, last_lane, x));
+    }
+
+    unsigned long long cuml_count = i ? out[i - 1] : 0;
+    for (; i < n; i++) {
+        cuml_count += buckets[i].count;
+        out[i] = cuml_count;
+    }
+}
+
+__attribute__((target("avx512f")))
+static size_t FindRankAVX512(const unsigned long long *counts, size_t n, unsigned long long &cumulative,
+                             unsigned long long rank) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        auto x = _mm512_add_epi64(
+                _mm512_add_epi64(_mm512_loadu_si512(counts + i), _mm512_loadu_si512(counts + i + 8)),
+                _mm512_add_epi64(_mm512_loadu_si512(counts + i + 16), _mm512_loadu_si512(counts + i + 24)));
+        auto y = _mm256_add_epi64(_mm512_maskz_extracti64x4_epi64(0xF, x, 0),
+                                  _mm512_maskz_extracti64x4_epi64(0xF, x, 1));
+        auto z = _mm_add_epi64(_mm256_castsi256_si128(y), _mm256_extracti128_si256(y, 1));
+        auto sum = (unsigned long long) _mm_cvtsi128_si64(_mm_add_epi64(z, _mm_unpackhi_epi64(z, z)));
+        if (cumulative + sum >= rank) break;
+        cumulative += sum;
+    }
+    return i + FindRankScalar(counts + i, n - i, cumulative, rank);
+}
+#endif
+
+const std::vector<Kernels> &Kernels::All() {
+    static const std::vector<Kernels> all = [] {
+        std::vector<Kernels> supported = {{"scalar", AddCountsScalar, CumulativeCountsScalar, FindRankScalar}};
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2")) {
+            supported.push_back({"sse4.2", AddCountsSSE42, CumulativeCountsScalar, FindRankSSE42});
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            supported.push_back({"avx2", AddCountsAVX2, CumulativeCountsAVX2, FindRankAVX2});
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            supported.push_back({"avx512", AddCountsAVX512, CumulativeCountsAVX512, FindRankAVX512});
+        }
+#endif
+        return supported;
+    }();
+    return all;
+}
+
+const Kernels &Kernels::Best() {
+    return All().back();
+}
+
+// Picked when the library is loaded, so hot loops only call through a pointer
+static const Kernels &kernels = Kernels::Best();
+
 std::optional<Metadata> Metadata::Deserialize(const char *in, size_t length) {
     return Decoder(in, length).ReadMetadata();
 }
@@ -16,7 +266,7 @@ bool Metadata::Valid() const {
         return false;
     }
 
-    if (version != 1) {
+    if (version < 1 || version > 3) {
         return false;
     }
 
@@ -27,8 +277,9 @@ bool Metadata::Valid() const {
     return true;
 }
 
+// All versions decode to the same buckets, so only gamma needs to match
 bool Metadata::Mergeable(const Metadata &other) const {
-    return gamma == other.gamma && version == other.version;
+    return gamma == other.gamma;
 }
 
 double Metadata::Mean() const {
@@ -43,13 +294,49 @@ double Metadata::Sum() const {
     return sum;
 }
 
+// Number of measurements at or below quantile q
+unsigned long long Metadata::Rank(double q) const {
+    if (q < 0) {
+        q = 0;
+    }
+    return llround(q * (double) count);
+}
+
+/*
+ * The values above a bucket exceed fraction of the count (1 - rank > fraction,
+ * as dds_exceeds documents it) when the values up to the bucket are fewer than
+ * this limit, from 0 (never) to count + 1 (always). (1 - fraction) * count
+ * rounded up is only an estimate, as the rank is a rounded division, so it is
+ * moved to where the documented comparison changes.
+ */
+unsigned long long Metadata::ExceedsLimit(double fraction) const {
+    auto exceeds = [&](unsigned long long cuml_count) {
+        return 1 - (double) cuml_count / (double) count > fraction;
+    };
+
+    double estimate = ceil((1 - fraction) * (double) count);
+    auto limit = estimate <= 0 ? 0 : estimate > (double) count ? count + 1 : (unsigned long long) estimate;
+    while (limit > 0 && !exceeds(limit - 1)) limit--;
+    while (limit <= count && exceeds(limit)) limit++;
+
+    return limit;
+}
+
+// Representative value of the bucket with the given key
+double Metadata::Value(unsigned short key) const {
+    return (2 * pow(gamma, key)) / (gamma + 1);
+}
+
 Decoder::Decoder(const char *in, size_t length) {
     data = in;
     end = in + length;
 }
 
 bool Decoder::Empty() const {
-    return data >= end;
+    if (version == 2) {
+        return bucket_index >= bucket_count;
+    }
+    return data >= end && span_left == 0;
 }
 
 std::optional<const char *> Decoder::Advance(size_t length) {
@@ -68,7 +355,45 @@ std::optional<uint64_t> Decoder::ReadVarint64() {
     return ReadVarint(10);
 }
 
+/*
+ * Reads a varint of at most max_length bytes. When at least 8 bytes of input
+ * are left, the next 8 bytes are loaded as a single word and the terminating
+ * byte is found from the continuation bits, so decoding doesn't branch per
+ * byte. Varints longer than 8 bytes and reads near the end of the input use
+ * the byte-by-byte ReadVarintChecked.
+ */
 std::optional<uint64_t> Decoder::ReadVarint(int max_length) {
+    if (BytesLeft() < 8) {
+        return ReadVarintChecked(max_length);
+    }
+
+    uint64_t word;
+    memcpy(&word, data, 8);
+
+    // High bit of each byte that terminates a varint
+    uint64_t stops = ~word & 0x8080808080808080ULL;
+    if (stops == 0) {
+        return ReadVarintChecked(max_length);
+    }
+
+    int length = (__builtin_ctzll(stops) >> 3) + 1;
+    if (length > max_length) {
+        return {};
+    }
+
+    // Drop the bytes after the terminator and the continuation bits, then
+    // pack the 7 bit groups together in three steps (8 -> 16 -> 32 -> 64
+    // bit lanes).
+    uint64_t x = word & (0x7f7f7f7f7f7f7f7fULL >> (64 - length * 8));
+    x = ((x & 0x7f007f007f007f00ULL) >> 1) | (x & 0x007f007f007f007fULL);
+    x = ((x & 0x3fff00003fff0000ULL) >> 2) | (x & 0x00003fff00003fffULL);
+    x = ((x & 0x0fffffff00000000ULL) >> 4) | (x & 0x000000000fffffffULL);
+
+    data += length;
+    return x;
+}
+
+std::optional<uint64_t> Decoder::ReadVarintChecked(int max_length) {
     auto max = end - data > max_length ? data + max_length : end;
     int shift = 0;
     uint64_t ret = 0;
@@ -129,10 +454,88 @@ std::optional<Metadata> Decoder::ReadMetadata() {
 
     if (!metadata.Valid()) return {};
 
+    if (metadata.version == 2 && !ReadBucketBlocks()) return {};
+    this->version = metadata.version;
+
     return metadata;
 }
 
+// Data bytes used by the four counts described by a version 2 count control
+// byte (2 bits per count, for a 1, 2, 4 or 8 byte count)
+static constexpr std::array<unsigned char, 256> COUNT_BLOCK_LENGTHS = [] {
+    std::array<unsigned char, 256> lengths{};
+    for (int control = 0; control < 256; control++) {
+        for (int i = 0; i < 4; i++) {
+            lengths[control] += 1 << ((control >> (i * 2)) & 3);
+        }
+    }
+    return lengths;
+}();
+
+/*
+ * Reads the version 2 bucket count and control bytes, and checks that the
+ * key and count blocks they describe exactly fill the rest of the input, so
+ * individual buckets can be read without bounds checks.
+ */
+bool Decoder::ReadBucketBlocks() {
+    auto n = ReadVarint64();
+    if (!n) return false;
+
+    // Each bucket takes at least 2 bytes, which also bounds n before it is
+    // used in any size arithmetic
+    if (n.value() > BytesLeft()) return false;
+
+    auto key_control_length = (n.value() + 7) / 8;
+    auto count_control_length = (n.value() + 3) / 4;
+
+    auto key_control_ptr = Advance(key_control_length);
+    if (!key_control_ptr) return false;
+    auto count_control_ptr = Advance(count_control_length);
+    if (!count_control_ptr) return false;
+
+    key_control = (const unsigned char *) key_control_ptr.value();
+    count_control = (const unsigned char *) count_control_ptr.value();
+
+    // Control bits past the last bucket must be zero
+    auto key_tail = n.value() % 8;
+    if (key_tail && key_control[key_control_length - 1] >> key_tail) return false;
+    auto count_tail = n.value() % 4;
+    if (count_tail && count_control[count_control_length - 1] >> (count_tail * 2)) return false;
+
+    size_t key_bytes = n.value();
+    for (size_t i = 0; i < key_control_length; i++) {
+        key_bytes += __builtin_popcount(key_control[i]);
+    }
+
+    size_t count_bytes = 0;
+    for (size_t i = 0; i < count_control_length; i++) {
+        count_bytes += COUNT_BLOCK_LENGTHS[count_control[i]];
+    }
+    if (count_tail) {
+        count_bytes -= 4 - count_tail; // unused (zero) codes counted as 1 byte each
+    }
+
+    if (BytesLeft() != key_bytes + count_bytes) return false;
+
+    keys = data;
+    counts = data + key_bytes;
+    data = end;
+
+    version = 2;
+    bucket_count = n.value();
+    bucket_index = 0;
+
+    return true;
+}
+
 std::optional<Bucket> Decoder::ReadBucket() {
+    if (version == 2) {
+        return ReadBucketV2();
+    }
+    if (version == 3) {
+        return ReadBucketV3();
+    }
+
     auto key = ReadVarint16();
     if (!key) return {};
 
@@ -145,263 +548,1798 @@ std::optional<Bucket> Decoder::ReadBucket() {
     return Bucket{.key = cur_key, .count = count.value()};
 }
 
-size_t Decoder::BytesLeft() const {
-    return end - data;
+// Reads a little endian integer of length bytes (at most 8)
+static inline uint64_t ReadLittleEndian(const char *in, size_t length) {
+    uint64_t val = 0;
+    memcpy(&val, in, length);
+    return val;
 }
 
-std::vector<uint8_t> Sketch::EncodeVarint(uint64_t val) {
-    std::vector<uint8_t> ret;
+std::optional<Bucket> Decoder::ReadBucketV2() {
+    if (bucket_index >= bucket_count) return {};
+    auto i = bucket_index++;
 
-    while (val & ~0x7F) {
-        ret.push_back((val & 0xFF) | 0x80);
-        val = val >> 7;
-    }
+    size_t key_length = 1 + ((key_control[i >> 3] >> (i & 7)) & 1);
+    size_t count_length = 1 << ((count_control[i >> 2] >> ((i & 3) * 2)) & 3);
 
-    ret.push_back(val);
+    auto delta = ReadLittleEndian(keys, key_length);
+    keys += key_length;
+    auto count = ReadLittleEndian(counts, count_length);
+    counts += count_length;
 
-    return ret;
-}
+    unsigned short cur_key = prev_key + delta;
+    prev_key = cur_key;
 
-std::optional<Sketch> Sketch::Deserialize(const char *in, size_t length) {
-    Decoder decoder = {in, length};
+    return Bucket{.key = cur_key, .count = count};
+}
 
-    auto metadata = decoder.ReadMetadata();
-    if (!metadata) return {};
+/*
+ * Version 3 buckets start with a varint header of (key delta << 1 | span).
+ * A single bucket is followed by its count. A span is followed by its length
+ * and then the counts of that many consecutive keys, starting at the key given
+ * by the delta.
+ */
+std::optional<Bucket> Decoder::ReadBucketV3() {
+    if (span_left > 0) {
+        auto count = ReadVarint64();
+        if (!count) return {};
+
+        span_left--;
+        prev_key++;
+        return Bucket{.key = (unsigned short) prev_key, .count = count.value()};
+    }
 
-    std::vector<Bucket> buckets;
+    auto header = ReadVarint(3);
+    if (!header) return {};
 
-    // Smallest bucket is 2 bytes, so this gives us an upper bound on the number of buckets
-    // Doing this allows us to avoid reallocations which has a measurable performance impact
-    buckets.reserve(decoder.BytesLeft() / 2);
+    auto key = prev_key + (header.value() >> 1);
+    if (key > USHRT_MAX) return {};
 
-    while (!decoder.Empty()) {
-        auto bucket = decoder.ReadBucket();
-        if (!bucket) return {};
-        buckets.push_back(bucket.value());
+    if (header.value() & 1) {
+        auto length = ReadVarint(3);
+        if (!length || length.value() == 0 || key + length.value() - 1 > USHRT_MAX) return {};
+        span_left = length.value() - 1;
     }
 
-    if (buckets.empty()) return {};
-    buckets.shrink_to_fit();
+    auto count = ReadVarint64();
+    if (!count) return {};
 
-    return Sketch{
-            .metadata = metadata.value(),
-            .buckets = buckets,
-    };
+    prev_key = key;
+    return Bucket{.key = (unsigned short) key, .count = count.value()};
 }
 
-double Sketch::Quantile(double q) const {
-    if (q < 0) {
-        q = 0;
+// Adds the counts of the rest of the current span to out, where out[0] is
+// the count of the key after the last bucket read.
+bool Decoder::ReadSpanCounts(unsigned long long *out) {
+    for (unsigned long long i = 0; i < span_left; i++) {
+        auto count = ReadVarint64();
+        if (!count) return false;
+        out[i] += count.value();
     }
-    unsigned long long rank = llround(q * (double) metadata.count);
 
-    unsigned long long cuml_count = 0;
-    unsigned short bucket_key = buckets.empty() ? 0 : buckets.back().key;
+    prev_key += span_left;
+    span_left = 0;
+    return true;
+}
 
-    for (auto bucket: buckets) {
-        cuml_count += bucket.count;
+size_t Decoder::BytesLeft() const {
+    return end - data;
+}
 
-        if (cuml_count >= rank) {
-            bucket_key = bucket.key;
-            break;
-        }
+// Upper bound on the number of buckets left to read
+size_t Decoder::MaxBucketsLeft() const {
+    if (version == 2) {
+        return bucket_count - bucket_index;
     }
 
-    return (2 * pow(metadata.gamma, bucket_key)) / (metadata.gamma + 1);
+    // Buckets within a version 3 span can be a single byte, otherwise the
+    // smallest bucket is 2 bytes
+    if (version == 3) {
+        return BytesLeft() + span_left;
+    }
+    return BytesLeft() / 2;
 }
 
-std::string Sketch::Inspect() const {
-    std::ostringstream out;
+GammaRemapper::GammaRemapper(float from, float to) {
+    ratio = log((double) from) / log((double) to);
 
-    out << "Sketch<version: " << (unsigned short) metadata.version << ", sum:" << metadata.sum << ", count:"
-        << metadata.count << ", gamma:"
-        << metadata.gamma << ", bucket_count: " << buckets.size();
-    out << ", buckets:{";
-    for (auto bucket: buckets) {
-        out << bucket.key << ": " << bucket.count << ", ";
+    // Gammas are stored as floats, so a power is only ever approximately exact
+    double inverse = 1 / ratio;
+    double rounded = round(inverse);
+    if (rounded >= 1 && fabs(inverse - rounded) < 1e-4 * rounded) {
+        power = (unsigned int) rounded;
     }
-    out << "}>";
-
-    return out.str();
 }
 
-std::string Sketch::JSON() {
-    std::ostringstream out;
-
-    out << "{"
-        << "\"version\":" << (unsigned short) metadata.version << ","
-        << "\"sum\":" << metadata.sum << ","
-        << "\"count\":" << metadata.count << ","
-        << "\"gamma\":"<< metadata.gamma << ",";
+std::array<Bucket, 2> GammaRemapper::Remap(const Bucket &bucket) const {
+    // Key 0 holds every value <= 1, for any gamma
+    if (bucket.key == 0) {
+        return {Bucket{.key = 0, .count = 0}, bucket};
+    }
 
-    out << "\"buckets\":{";
-    for (auto &bucket: buckets) {
-        out << "\"" << bucket.key << "\":" << bucket.count;
-        if (&bucket != &buckets.back()) {
-            out << ",";
-        }
+    if (power) {
+        auto key = (unsigned short) ((bucket.key + power - 1) / power);
+        return {Bucket{.key = key, .count = 0}, Bucket{.key = key, .count = bucket.count}};
     }
-    out << "}";
 
-    out << "}";
+    double low = (bucket.key - 1) * ratio;
+    double high = bucket.key * ratio;
+    auto key = (unsigned short) ceil(high);
+    if (key - 1 <= low) {
+        return {Bucket{.key = key, .count = 0}, Bucket{.key = key, .count = bucket.count}};
+    }
 
-    return out.str();
+    auto upper = (unsigned long long) llround((double) bucket.count * (high - (key - 1)) / ratio);
+    if (upper > bucket.count) upper = bucket.count;
+    return {Bucket{.key = (unsigned short) (key - 1), .count = bucket.count - upper},
+            Bucket{.key = key, .count = upper}};
 }
 
-std::string Sketch::Serialize() const {
-    std::ostringstream out;
+KeyMapper::KeyMapper(double in_gamma) {
+    gamma = in_gamma;
+    inv_log2_gamma = 1 / log2(gamma);
+    bounds.push_back(1.0);
+}
 
-    out.write((const char *) &metadata.version, 1);
-    out.write((const char *) &metadata.gamma, 4);
-    out.write((const char *) &metadata.sum, 4);
+double KeyMapper::Gamma(double alpha) {
+    return (1 + alpha) / (1 - alpha);
+}
 
-    auto varint = EncodeVarint(metadata.count);
-    out.write((const char *) varint.data(), (long) varint.size());
+// log2 approximation with exact results at powers of two. Uses the cubic
+// interpolation of the mantissa from the DDSketch paper, which has a maximum
+// error of about 0.0015 (a twentieth of a key for the default gamma).
+static double FastLog2(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
 
-    unsigned short prev_key = 0;
-    for (auto bucket: buckets) {
-        varint = EncodeVarint(bucket.key - prev_key);
-        out.write((const char *) varint.data(), (long) varint.size());
-        prev_key = bucket.key;
+    auto exponent = (int) ((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
 
-        varint = EncodeVarint(bucket.count);
-        out.write((const char *) varint.data(), (long) varint.size());
-    }
+    double mantissa;
+    memcpy(&mantissa, &bits, 8);
 
-    return out.str();
+    double s = mantissa - 1;
+    return exponent + ((6.0 / 35 * s - 3.0 / 5) * s + 10.0 / 7) * s;
 }
 
-bool Accumulator::Merge(const char *in, size_t length) {
-    Decoder decoder = {in, length};
+std::optional<unsigned short> KeyMapper::Key(double value) {
+    if (!(value <= DBL_MAX) || value < 0) {
+        return {}; // NaN, infinite or negative
+    }
+    if (value <= 1) {
+        return 0;
+    }
 
-    auto in_metadata = decoder.ReadMetadata();
-    if (!in_metadata) return false;
+    return RefineKey(value, ceil(FastLog2(value) * inv_log2_gamma));
+}
 
-    if (metadata) {
-        if (!metadata.value().Mergeable(in_metadata.value())) {
-            return false;
+// Keys of n values, the same as Key. The estimates are computed for all the
+// values first, in a loop without branches or calls that the compiler can
+// vectorize, then corrected one by one. Returns false if any value can't be
+// mapped.
+bool KeyMapper::Keys(const double *values, size_t n, unsigned short *keys) {
+    double estimates[KEYS_BATCH_SIZE];
+
+    for (size_t start = 0; start < n; start += KEYS_BATCH_SIZE) {
+        size_t batch = n - start < KEYS_BATCH_SIZE ? n - start : KEYS_BATCH_SIZE;
+        const double *in = values + start;
+
+        bool valid = true;
+        for (size_t i = 0; i < batch; i++) {
+            double value = in[i] > 1 && in[i] <= DBL_MAX ? in[i] : 1;
+            estimates[i] = ceil(FastLog2(value) * inv_log2_gamma);
+            valid &= in[i] >= 0 && in[i] <= DBL_MAX;
+        }
+        if (!valid) return false;
+
+        for (size_t i = 0; i < batch; i++) {
+            if (in[i] <= 1) {
+                keys[start + i] = 0;
+                continue;
+            }
+            auto key = RefineKey(in[i], estimates[i]);
+            if (!key) return false;
+            keys[start + i] = key.value();
         }
-
-        metadata.value().sum += in_metadata.value().sum;
-        metadata.value().count += in_metadata.value().count;
-    } else {
-        metadata = in_metadata;
     }
 
-    while (!decoder.Empty()) {
-        auto bucket = decoder.ReadBucket();
-        if (!bucket) return false;
+    return true;
+}
 
-        buckets[bucket.value().key] += bucket.value().count;
+// Corrects an estimate of value's key from FastLog2, which is at most one off.
+// An estimate of USHRT_MAX + 1 may still be a key of USHRT_MAX, so it is
+// corrected from USHRT_MAX and only rejected if the key is still past it.
+std::optional<unsigned short> KeyMapper::RefineKey(double value, double estimate) {
+    if (estimate > USHRT_MAX + 1.0) {
+        return {};
     }
 
-    if (buckets.empty()) {
-        return false;
+    // Bucket k covers (gamma ^ (k - 1), gamma ^ k]
+    size_t key = estimate > USHRT_MAX ? USHRT_MAX : (size_t) estimate;
+    GrowBounds(key + 1);
+    while (key > 0 && value <= bounds[key - 1]) {
+        key--;
+    }
+    while (value > bounds[key]) {
+        key++;
+        if (key > USHRT_MAX) return {};
+        GrowBounds(key);
     }
 
-    return true;
+    return (unsigned short) key;
 }
 
-Sketch Accumulator::ToSketch() const {
-    std::vector<Bucket> ordered;
-    ordered.reserve(buckets.size());
-    for (auto &[key, val]: buckets) {
-        ordered.push_back({.key = key, .count = val});
+void KeyMapper::GrowBounds(size_t key) {
+    while (bounds.size() <= key) {
+        bounds.push_back(pow(gamma, (double) bounds.size()));
     }
-    std::sort(ordered.begin(), ordered.end());
-
-    return {
-            .metadata = metadata.value(),
-            .buckets = ordered,
-    };
 }
 
-void Accumulator::Clear() {
-    metadata.reset();
-    buckets.clear();
-}
+double ValueTable::Value(const Metadata &metadata, unsigned short key) {
+    size_t table = 0;
+    while (table < GAMMAS && gammas[table] != metadata.gamma && gammas[table] != 0) table++;
+    if (table == GAMMAS) return metadata.Value(key);
 
-extern "C" [[maybe_unused]] bool dds_inspect_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
-    if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
-        strcpy(message, "Requires exactly one sketch argument");
-        return true;
+    gammas[table] = metadata.gamma;
+    auto &table_values = values[table];
+    while (table_values.size() <= key) {
+        table_values.push_back(metadata.Value(table_values.size()));
     }
 
-    initid->maybe_null = true;
-    initid->max_length = 65535;
-    initid->ptr = static_cast<char *>(static_cast<void *>(new std::string()));
+    return table_values[key];
+}
 
-    return false;
+void QuantileQuery::Set(const double *in, size_t n) {
+    qs.assign(in, in + n);
+    Sort();
 }
 
-extern "C" [[maybe_unused]] char *dds_inspect(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length,
-                                              unsigned char *is_null, char *error) {
-    if (!args->args[0]) {
-        return nullptr;
+void QuantileQuery::Sort() {
+    values.assign(qs.size(), 0.0);
+
+    order.resize(qs.size());
+    for (size_t i = 0; i < qs.size(); i++) {
+        order[i] = i;
     }
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) { return qs[a] < qs[b]; });
+}
 
-    auto sketch = Sketch::Deserialize(args->args[0], args->lengths[0]);
+void QuantileQuery::Start(const Metadata &in_metadata) {
+    metadata = in_metadata;
+    cuml_count = 0;
+    next = 0;
+    last_key.reset();
 
-    if (!sketch) {
-        *error = 1;
-        return nullptr;
+    ranks.resize(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        ranks[i] = metadata.Rank(qs[order[i]]);
     }
+}
 
-    auto *out = static_cast<std::string *>(static_cast<void *>(initid->ptr));
-    out->assign(sketch.value().Inspect());
+bool QuantileQuery::Add(const Bucket &bucket) {
+    cuml_count += bucket.count;
+    last_key = bucket.key;
 
-    *length = out->length();
-    *is_null = 0;
+    while (next < order.size() && cuml_count >= ranks[next]) {
+        values[order[next]] = metadata.Value(bucket.key);
+        next++;
+    }
 
-    return out->data();
-}
-extern "C" [[maybe_unused]] void dds_inspect_deinit(UDF_INIT *initid) {
-    delete static_cast<std::string *>(static_cast<void *>(initid->ptr));
+    return next == order.size();
 }
 
-struct Sum_Data {
-    Accumulator acc;
-    std::string serialized;
-    bool set = false;
-};
+// Quantiles beyond the last bucket (q > 1) get the last bucket's value, like
+// Sketch#Quantile. Returns false if no buckets were added.
+bool QuantileQuery::Finish() {
+    if (!last_key) return false;
 
-extern "C" [[maybe_unused]] bool dds_sum_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
-    if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
-        strcpy(message, "Requires exactly one sketch argument");
-        return true;
+    for (; next < order.size(); next++) {
+        values[order[next]] = metadata.Value(last_key.value());
     }
 
-    initid->maybe_null = true;
-    initid->max_length = 65535;
-    initid->ptr = static_cast<char *>(static_cast<void *>(new Sum_Data()));
-
-    return false;
+    return true;
 }
 
-extern "C" [[maybe_unused]] void dds_sum_add(UDF_INIT *initid, UDF_ARGS *args, char *, char *error) {
-    if (args->args[0] == nullptr) {
-        return;
+std::string QuantileQuery::JSON() const {
+    std::string out = "[";
+    char buf[32];
+
+    for (size_t i = 0; i < values.size(); i++) {
+        if (i > 0) out += ",";
+        // JSON has no infinity or NaN, which a quantile overflowing a double
+        // would otherwise be written as
+        if (!std::isfinite(values[i])) {
+            out += "null";
+            continue;
+        }
+        auto result = std::to_chars(buf, buf + sizeof(buf), values[i]);
+        out.append(buf, result.ptr);
     }
+    out += "]";
 
-    auto *data = static_cast<Sum_Data *>(static_cast<void *>(initid->ptr));
+    return out;
+}
 
-    auto success = data->acc.Merge(args->args[0], args->lengths[0]);
-    if (!success) {
-        *error = true;
-        return;
+std::vector<uint8_t> Sketch::EncodeVarint(uint64_t val) {
+    std::vector<uint8_t> ret;
+
+    while (val & ~0x7F) {
+        ret.push_back((val & 0xFF) | 0x80);
+        val = val >> 7;
     }
 
-    data->set = true;
+    ret.push_back(val);
+
+    return ret;
 }
 
-extern "C" [[maybe_unused]] void dds_sum_clear(UDF_INIT *initid, char *, char *) {
-    auto *data = static_cast<Sum_Data *>(static_cast<void *>(initid->ptr));
+std::optional<Sketch> Sketch::Deserialize(const char *in, size_t length) {
+    Decoder decoder = {in, length};
 
-    data->acc.Clear();
-    data->set = false;
-}
+    auto metadata = decoder.ReadMetadata();
+    if (!metadata) return CountDecoded(length, false), std::nullopt;
 
-extern "C" [[maybe_unused]] char *
+    std::vector<Bucket> buckets;
+
+    // Reserving an upper bound on the number of buckets allows us to avoid
+    // reallocations which has a measurable performance impact
+    buckets.reserve(decoder.MaxBucketsLeft());
+
+    while (!decoder.Empty()) {
+        auto bucket = decoder.ReadBucket();
+        if (!bucket) return CountDecoded(length, false), std::nullopt;
+        buckets.push_back(bucket.value());
+    }
+
+    if (!CountDecoded(length, !buckets.empty())) return {};
+    buckets.shrink_to_fit();
+
+    return Sketch{
+            .metadata = metadata.value(),
+            .buckets = buckets,
+    };
+}
+
+double Sketch::Quantile(double q) const {
+    return metadata.Value(QuantileKey(q));
+}
+
+unsigned short Sketch::QuantileKey(double q) const {
+    if (buckets.empty()) return 0;
+    unsigned long long rank = metadata.Rank(q);
+
+    // First bucket whose cumulative count reaches the rank, or the last bucket
+    if (Indexed()) {
+        auto it = std::lower_bound(cuml_counts.begin(), cuml_counts.end(), rank);
+        if (it == cuml_counts.end()) {
+            return buckets.back().key;
+        }
+        return buckets[it - cuml_counts.begin()].key;
+    }
+
+    unsigned long long cuml_count = 0;
+    for (auto bucket: buckets) {
+        cuml_count += bucket.count;
+        if (cuml_count >= rank) return bucket.key;
+    }
+    return buckets.back().key;
+}
+
+void Sketch::Quantiles(QuantileQuery &query) const {
+    query.Start(metadata);
+    if (!Indexed()) {
+        for (auto bucket: buckets) {
+            if (query.Add(bucket)) break;
+        }
+        query.Finish();
+        return;
+    }
+
+    // Ranks are in increasing order, so each search starts at the last match
+    auto it = cuml_counts.begin();
+    for (; query.next < query.order.size(); query.next++) {
+        it = std::lower_bound(it, cuml_counts.end(), query.ranks[query.next]);
+        if (it == cuml_counts.end()) break;
+        query.values[query.order[query.next]] = metadata.Value(buckets[it - cuml_counts.begin()].key);
+    }
+
+    query.last_key = buckets.back().key;
+    query.Finish();
+}
+
+// Number of values in buckets with keys up to and including key
+unsigned long long Sketch::CumulativeCount(unsigned short key) const {
+    if (!Indexed()) {
+        unsigned long long cuml_count = 0;
+        for (auto bucket: buckets) {
+            if (bucket.key > key) break;
+            cuml_count += bucket.count;
+        }
+        return cuml_count;
+    }
+
+    auto it = std::upper_bound(buckets.begin(), buckets.end(), Bucket{.key = key, .count = 0});
+    if (it == buckets.begin()) {
+        return 0;
+    }
+    return cuml_counts[it - buckets.begin() - 1];
+}
+
+void Sketch::BuildIndex() {
+    cuml_counts.resize(buckets.size());
+    kernels.cumulative_counts(buckets.data(), buckets.size(), cuml_counts.data());
+}
+
+bool Sketch::Indexed() const {
+    return !buckets.empty() && cuml_counts.size() == buckets.size();
+}
+
+// Appends a number formatted by std::to_chars, which doesn't depend on the
+// locale or on stream state
+template<typename T, typename... Format>
+static void AppendNumber(std::string &out, T value, Format... format) {
+    char buf[32];
+    auto result = std::to_chars(buf, buf + sizeof(buf), value, format...);
+    out.append(buf, result.ptr);
+}
+
+// Appends a number for JSON, which has no infinity or NaN: those are null
+template<typename T>
+static void AppendJSONNumber(std::string &out, T value) {
+    if (!std::isfinite(value)) {
+        out += "null";
+        return;
+    }
+    AppendNumber(out, value);
+}
+
+// Appends sum or gamma the way ostream prints them (%g, 6 significant
+// digits), which dds_inspect has always output
+static void AppendFloat(std::string &out, float value) {
+    AppendNumber(out, (double) value, std::chars_format::general, 6);
+}
+
+// Longest rendering of a bucket in InspectSketch and SketchJSON: a 5 digit
+// key, a 20 digit count and 4 separator characters
+static const size_t MAX_BUCKET_CHARS = 29;
+
+template<typename Buckets>
+static void InspectSketch(std::string &out, const Metadata &metadata, const Buckets &buckets,
+                          size_t bucket_count) {
+    out.clear();
+    out.reserve(128 + bucket_count * MAX_BUCKET_CHARS);
+
+    out += "Sketch<version: ";
+    AppendNumber(out, metadata.version);
+    out += ", sum:";
+    AppendFloat(out, metadata.sum);
+    out += ", count:";
+    AppendNumber(out, metadata.count);
+    out += ", gamma:";
+    AppendFloat(out, metadata.gamma);
+    out += ", bucket_count: ";
+    AppendNumber(out, bucket_count);
+    out += ", buckets:{";
+    for (auto bucket: buckets) {
+        AppendNumber(out, bucket.key);
+        out += ": ";
+        AppendNumber(out, bucket.count);
+        out += ", ";
+    }
+    out += "}>";
+}
+
+// max_buckets is an upper bound on the number of buckets, to size out. Sum
+// and gamma are written in the shortest form that reads back as the same
+// float, so Sketch#FromJSON gets back the exact sketch.
+template<typename Buckets>
+static void SketchJSON(std::string &out, const Metadata &metadata, const Buckets &buckets, size_t max_buckets) {
+    out.clear();
+    out.reserve(128 + max_buckets * MAX_BUCKET_CHARS);
+
+    out += "{\"version\":";
+    AppendNumber(out, metadata.version);
+    out += ",\"sum\":";
+    AppendNumber(out, metadata.sum);
+    out += ",\"count\":";
+    AppendNumber(out, metadata.count);
+    out += ",\"gamma\":";
+    AppendNumber(out, metadata.gamma);
+
+    out += ",\"buckets\":{";
+    bool first = true;
+    for (auto bucket: buckets) {
+        if (!first) {
+            out += ',';
+        }
+        out += '"';
+        AppendNumber(out, bucket.key);
+        out += "\":";
+        AppendNumber(out, bucket.count);
+        first = false;
+    }
+    out += "}}";
+}
+
+std::string Sketch::Inspect() const {
+    std::string out;
+    InspectSketch(out, metadata, buckets, buckets.size());
+    return out;
+}
+
+std::string Sketch::JSON() {
+    std::string out;
+    SketchJSON(out, metadata, buckets, buckets.size());
+    return out;
+}
+
+/*
+ * Reads the JSON written by SketchJSON, token by token straight from the
+ * input, allowing whitespace between tokens. The only allocation is the
+ * bucket vector.
+ */
+struct JSONReader {
+    const char *p;
+    const char *end;
+
+    void SkipSpace() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    }
+
+    bool Peek(char c) {
+        SkipSpace();
+        return p < end && *p == c;
+    }
+
+    bool Expect(char c) {
+        if (!Peek(c)) return false;
+        p++;
+        return true;
+    }
+
+    // "name":
+    bool Field(std::string_view name) {
+        if (!Expect('"')) return false;
+        if ((size_t) (end - p) < name.size() + 1 || memcmp(p, name.data(), name.size()) != 0 ||
+            p[name.size()] != '"') {
+            return false;
+        }
+        p += name.size() + 1;
+        return Expect(':');
+    }
+
+    template<typename T>
+    bool Number(T &value) {
+        SkipSpace();
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc() || result.ptr == p) return false;
+        p = result.ptr;
+        return true;
+    }
+
+    // "key": with the key quoted, as JSON object keys must be
+    bool BucketKey(unsigned short &key) {
+        if (!Expect('"')) return false;
+        auto result = std::from_chars(p, end, key);
+        if (result.ec != std::errc() || result.ptr == p || result.ptr == end || *result.ptr != '"') return false;
+        p = result.ptr + 1;
+        return Expect(':');
+    }
+};
+
+// Parses the JSON of Sketch#JSON (and dds_json), with its fields in the same
+// order. Returns nothing unless the metadata is Valid and the buckets are in
+// increasing key order.
+std::optional<Sketch> Sketch::FromJSON(const char *in, size_t length) {
+    JSONReader reader = {in, in + length};
+    Metadata metadata;
+    unsigned short version = 0;
+
+    if (!reader.Expect('{') ||
+        !reader.Field("version") || !reader.Number(version) || !reader.Expect(',') ||
+        !reader.Field("sum") || !reader.Number(metadata.sum) || !reader.Expect(',') ||
+        !reader.Field("count") || !reader.Number(metadata.count) || !reader.Expect(',') ||
+        !reader.Field("gamma") || !reader.Number(metadata.gamma) || !reader.Expect(',') ||
+        !reader.Field("buckets") || !reader.Expect('{')) {
+        return {};
+    }
+
+    // from_chars reads inf and nan, which aren't JSON
+    if (version > UCHAR_MAX || !std::isfinite(metadata.sum) || !std::isfinite(metadata.gamma)) return {};
+    metadata.version = (unsigned char) version;
+    if (!metadata.Valid()) return {};
+
+    std::vector<Bucket> buckets;
+    // Each bucket takes at least 6 characters ("k":c,)
+    buckets.reserve(length / 6);
+    while (!reader.Peek('}')) {
+        if (!buckets.empty() && !reader.Expect(',')) return {};
+
+        Bucket bucket = {};
+        if (!reader.BucketKey(bucket.key) || !reader.Number(bucket.count)) return {};
+        if (!buckets.empty() && bucket.key <= buckets.back().key) return {};
+
+        buckets.push_back(bucket);
+    }
+
+    if (buckets.empty() || !reader.Expect('}') || !reader.Expect('}')) return {};
+    reader.SkipSpace();
+    if (reader.p != reader.end) return {};
+
+    return Sketch{
+            .metadata = metadata,
+            .buckets = buckets,
+    };
+}
+
+/*
+ * Adds count values of sum sum in bucket key to the serialized sketch in, and
+ * writes the result to out. Version 1 sketches are patched rather than
+ * decoded: buckets are read only up to key, then the output is the new
+ * metadata, the bytes before key, the rewritten bucket (or the new bucket and
+ * the next bucket's key delta), and the rest of in copied as is once it is
+ * checked to decode. Other versions are decoded and serialized again. Returns
+ * false if the sketch is invalid or its count would overflow.
+ */
+bool Sketch::AddSerialized(const char *in, size_t length, const Bucket &bucket, double sum, std::string &out) {
+    Decoder decoder = {in, length};
+
+    auto metadata = decoder.ReadMetadata();
+    if (!metadata || decoder.Empty()) return false;
+    if (metadata.value().count > ULLONG_MAX - bucket.count) return false;
+
+    metadata.value().count += bucket.count;
+    metadata.value().sum = (float) (metadata.value().sum + sum);
+
+    if (metadata.value().version != 1) {
+        auto sketch = Deserialize(in, length);
+        if (!sketch) return false;
+
+        auto buckets = sketch.value().buckets;
+        auto it = std::lower_bound(buckets.begin(), buckets.end(), bucket);
+        if (it != buckets.end() && it->key == bucket.key) {
+            if (it->count > ULLONG_MAX - bucket.count) return false;
+            it->count += bucket.count;
+        } else {
+            buckets.insert(it, bucket);
+        }
+
+        Sketch added = {.metadata = metadata.value(), .buckets = buckets};
+        out.resize(added.SerializedSize());
+        added.SerializeTo(out.data());
+        return true;
+    }
+
+    // Find the first bucket at or after key, and where it starts
+    const char *body = decoder.data;
+    const char *next = body;
+    unsigned short prev_key = 0;
+    std::optional<Bucket> found;
+    while (!decoder.Empty()) {
+        next = decoder.data;
+        auto current = decoder.ReadBucket();
+        if (!current) return false;
+        if (current.value().key >= bucket.key) {
+            found = current;
+            break;
+        }
+        prev_key = current.value().key;
+    }
+    if (!found) next = decoder.data;
+
+    // The rest is copied as is, but is still decoded first so that a corrupt
+    // sketch is rejected as it is by Deserialize
+    Decoder rest = decoder;
+    while (!rest.Empty()) {
+        if (!rest.ReadBucket()) return false;
+    }
+
+    // At most 3 varints of a key delta or count
+    out.resize(MetadataSize(metadata.value()) + (next - body) + 3 * 10 + decoder.BytesLeft());
+    char *pos = WriteMetadata(out.data(), metadata.value());
+    memcpy(pos, body, next - body);
+    pos += next - body;
+
+    if (found && found.value().key == bucket.key) {
+        if (found.value().count > ULLONG_MAX - bucket.count) return false;
+        pos = WriteVarint(pos, bucket.key - prev_key);
+        pos = WriteVarint(pos, found.value().count + bucket.count);
+    } else {
+        pos = WriteVarint(pos, bucket.key - prev_key);
+        pos = WriteVarint(pos, bucket.count);
+        if (found) {
+            pos = WriteVarint(pos, found.value().key - bucket.key);
+            pos = WriteVarint(pos, found.value().count);
+        }
+    }
+
+    memcpy(pos, decoder.data, decoder.BytesLeft());
+    pos += decoder.BytesLeft();
+    out.resize(pos - out.data());
+
+    return true;
+}
+
+std::string Sketch::Serialize() const {
+    std::string out(SerializedSize(), '\0');
+    SerializeTo(out.data());
+
+    return out;
+}
+
+size_t Sketch::VarintSize(uint64_t val) {
+    size_t size = 1;
+    while (val & ~0x7FULL) {
+        val >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+char *Sketch::WriteVarint(char *out, uint64_t val) {
+    while (val & ~0x7FULL) {
+        *out++ = (char) ((val & 0x7F) | 0x80);
+        val >>= 7;
+    }
+    *out++ = (char) val;
+
+    return out;
+}
+
+size_t Sketch::MetadataSize(const Metadata &metadata) {
+    return 1 + 4 + 4 + VarintSize(metadata.count);
+}
+
+char *Sketch::WriteMetadata(char *out, const Metadata &metadata) {
+    memcpy(out, &metadata.version, 1);
+    memcpy(out + 1, &metadata.gamma, 4);
+    memcpy(out + 5, &metadata.sum, 4);
+
+    return WriteVarint(out + 9, metadata.count);
+}
+
+// Length code of a version 2 count: 0, 1, 2 or 3 for 1, 2, 4 or 8 bytes
+static inline unsigned CountCode(uint64_t count) {
+    return count < (1ULL << 8) ? 0 : count < (1ULL << 16) ? 1 : count < (1ULL << 32) ? 2 : 3;
+}
+
+/*
+ * Version 3 writes runs of consecutive keys as spans. A span replaces the key
+ * delta of every bucket after the first (usually 1 byte each) with a single
+ * length, so it only saves space from 3 buckets on.
+ */
+static const size_t MIN_SPAN_LENGTH = 3;
+
+// Number of buckets with consecutive keys starting at it
+template<typename Iterator>
+static size_t SpanLength(Iterator it, const Iterator &end) {
+    size_t key = (*it).key;
+    size_t length = 1;
+
+    for (++it; it != end && (*it).key == key + length; ++it) {
+        length++;
+    }
+
+    return length;
+}
+
+// Exact number of bytes written by SerializeBuckets for buckets in key order
+template<typename Buckets>
+static size_t SerializedSize(const Metadata &metadata, const Buckets &buckets) {
+    size_t size = Sketch::MetadataSize(metadata);
+    unsigned short prev_key = 0;
+
+    if (metadata.version == 2) {
+        size_t n = 0;
+        for (auto bucket: buckets) {
+            size += (bucket.key - prev_key > 0xFF ? 2 : 1) + (1 << CountCode(bucket.count));
+            prev_key = bucket.key;
+            n++;
+        }
+        return size + Sketch::VarintSize(n) + (n + 7) / 8 + (n + 3) / 4;
+    }
+
+    if (metadata.version == 3) {
+        for (auto it = buckets.begin(); it != buckets.end();) {
+            Bucket first = *it;
+            auto length = SpanLength(it, buckets.end());
+
+            if (length >= MIN_SPAN_LENGTH) {
+                size += Sketch::VarintSize((first.key - prev_key) << 1 | 1) + Sketch::VarintSize(length);
+                for (size_t i = 0; i < length; i++, ++it) {
+                    size += Sketch::VarintSize((*it).count);
+                }
+                prev_key = first.key + length - 1;
+            } else {
+                size += Sketch::VarintSize((first.key - prev_key) << 1) + Sketch::VarintSize(first.count);
+                prev_key = first.key;
+                ++it;
+            }
+        }
+        return size;
+    }
+
+    for (auto bucket: buckets) {
+        size += Sketch::VarintSize(bucket.key - prev_key) + Sketch::VarintSize(bucket.count);
+        prev_key = bucket.key;
+    }
+
+    return size;
+}
+
+// Writes metadata and buckets (in key order) in the wire format of
+// metadata.version. out must have room for SerializedSize bytes.
+template<typename Buckets>
+static char *SerializeBuckets(char *out, const Metadata &metadata, const Buckets &buckets) {
+    out = Sketch::WriteMetadata(out, metadata);
+    unsigned short prev_key = 0;
+
+    if (metadata.version == 2) {
+        size_t n = 0;
+        size_t key_bytes = 0;
+        for (auto bucket: buckets) {
+            key_bytes += bucket.key - prev_key > 0xFF ? 2 : 1;
+            prev_key = bucket.key;
+            n++;
+        }
+
+        out = Sketch::WriteVarint(out, n);
+        auto *key_control = (unsigned char *) out;
+        auto *count_control = key_control + (n + 7) / 8;
+        char *keys = (char *) count_control + (n + 3) / 4;
+        char *counts = keys + key_bytes;
+        memset(key_control, 0, keys - out);
+
+        size_t i = 0;
+        prev_key = 0;
+        for (auto bucket: buckets) {
+            uint64_t delta = bucket.key - prev_key;
+            size_t key_length = delta > 0xFF ? 2 : 1;
+            key_control[i >> 3] |= (key_length - 1) << (i & 7);
+            memcpy(keys, &delta, key_length);
+            keys += key_length;
+
+            uint64_t count = bucket.count;
+            auto code = CountCode(count);
+            count_control[i >> 2] |= code << ((i & 3) * 2);
+            memcpy(counts, &count, 1 << code);
+            counts += 1 << code;
+
+            prev_key = bucket.key;
+            i++;
+        }
+
+        return counts;
+    }
+
+    if (metadata.version == 3) {
+        for (auto it = buckets.begin(); it != buckets.end();) {
+            Bucket first = *it;
+            auto length = SpanLength(it, buckets.end());
+
+            if (length >= MIN_SPAN_LENGTH) {
+                out = Sketch::WriteVarint(out, (first.key - prev_key) << 1 | 1);
+                out = Sketch::WriteVarint(out, length);
+                for (size_t i = 0; i < length; i++, ++it) {
+                    out = Sketch::WriteVarint(out, (*it).count);
+                }
+                prev_key = first.key + length - 1;
+            } else {
+                out = Sketch::WriteVarint(out, (first.key - prev_key) << 1);
+                out = Sketch::WriteVarint(out, first.count);
+                prev_key = first.key;
+                ++it;
+            }
+        }
+        return out;
+    }
+
+    for (auto bucket: buckets) {
+        out = Sketch::WriteVarint(out, bucket.key - prev_key);
+        out = Sketch::WriteVarint(out, bucket.count);
+        prev_key = bucket.key;
+    }
+
+    return out;
+}
+
+// Exact number of bytes written by SerializeTo
+size_t Sketch::SerializedSize() const {
+    return ::SerializedSize(metadata, buckets);
+}
+
+// Writes the serialized sketch to out, which must have room for
+// SerializedSize() bytes. Returns the end of the written bytes.
+char *Sketch::SerializeTo(char *out) const {
+    return SerializeBuckets(out, metadata, buckets);
+}
+
+std::optional<SketchView> SketchView::Deserialize(const char *in, size_t length) {
+    Decoder decoder = {in, length};
+
+    auto metadata = decoder.ReadMetadata();
+
+    // A sketch must have at least one bucket
+    if (!CountDecoded(length, metadata && !decoder.Empty())) return {};
+
+    return SketchView{
+            .metadata = metadata.value(),
+            .decoder = decoder,
+    };
+}
+
+SketchView::Iterator SketchView::begin() const {
+    Iterator it = {.decoder = decoder, .bucket = {}};
+    return ++it;
+}
+
+SketchView::Iterator SketchView::end() const {
+    return {.decoder = Decoder(decoder.end, 0), .bucket = {}};
+}
+
+// Decodes every bucket, returning the number of buckets or nothing if any
+// bucket fails to decode.
+std::optional<size_t> SketchView::BucketCount() const {
+    Decoder reader = decoder;
+    size_t count = 0;
+
+    while (!reader.Empty()) {
+        if (!reader.ReadBucket()) return {};
+        count++;
+    }
+
+    return count;
+}
+
+bool SketchView::Valid() const {
+    auto count = BucketCount();
+    return count && count.value() > 0;
+}
+
+std::optional<double> SketchView::Quantile(double q) const {
+    auto key = QuantileKey(q);
+    if (!key) return {};
+
+    return metadata.Value(key.value());
+}
+
+// Walks buckets only until the target rank is reached, so buckets past the
+// quantile are neither decoded nor validated.
+std::optional<unsigned short> SketchView::QuantileKey(double q) const {
+    unsigned long long rank = metadata.Rank(q);
+    unsigned long long cuml_count = 0;
+
+    Decoder reader = decoder;
+    std::optional<Bucket> bucket;
+
+    while (!reader.Empty()) {
+        bucket = reader.ReadBucket();
+        if (!bucket) return {};
+
+        cuml_count += bucket.value().count;
+        if (cuml_count >= rank) {
+            break;
+        }
+    }
+
+    if (!bucket) return {};
+
+    return bucket.value().key;
+}
+
+// Number of values in buckets with keys up to and including key, like
+// Sketch#CumulativeCount. The walk stops at the first bucket past key, or
+// as soon as the count reaches limit (so the result is at least limit),
+// leaving the rest of the buckets undecoded.
+std::optional<unsigned long long> SketchView::CumulativeCount(unsigned short key, unsigned long long limit) const {
+    unsigned long long cuml_count = 0;
+
+    Decoder reader = decoder;
+    while (!reader.Empty() && cuml_count < limit) {
+        auto bucket = reader.ReadBucket();
+        if (!bucket) return {};
+        if (bucket.value().key > key) break;
+
+        cuml_count += bucket.value().count;
+    }
+
+    return cuml_count;
+}
+
+bool SketchView::Quantiles(QuantileQuery &query) const {
+    query.Start(metadata);
+
+    Decoder reader = decoder;
+    while (!reader.Empty()) {
+        auto bucket = reader.ReadBucket();
+        if (!bucket) return false;
+
+        if (query.Add(bucket.value())) break;
+    }
+
+    return query.Finish();
+}
+
+std::string SketchView::Inspect() const {
+    std::string out;
+    Inspect(out);
+    return out;
+}
+
+void SketchView::Inspect(std::string &out) const {
+    InspectSketch(out, metadata, *this, BucketCount().value_or(0));
+}
+
+std::string SketchView::JSON() const {
+    std::string out;
+    JSON(out);
+    return out;
+}
+
+void SketchView::JSON(std::string &out) const {
+    SketchJSON(out, metadata, *this, decoder.MaxBucketsLeft());
+}
+
+/*
+ * JSON for clients that want values rather than keys: count, sum and gamma
+ * followed by either the quantiles of query, if given, or every bucket as
+ * [lower bound, upper bound, count] (a bucket holds the values in
+ * (gamma^(key - 1), gamma^key]). Numbers are written in the shortest form
+ * that reads back as the same float or double, or as null if they aren't
+ * finite. Returns false if the sketch is invalid.
+ */
+bool SketchView::CompactJSON(std::string &out, QuantileQuery *query) const {
+    out.clear();
+    if (query && !Quantiles(*query)) return false;
+
+    out += "{\"count\":";
+    AppendNumber(out, metadata.count);
+    out += ",\"sum\":";
+    AppendJSONNumber(out, metadata.sum);
+    out += ",\"gamma\":";
+    AppendNumber(out, metadata.gamma);
+
+    if (query) {
+        out += ",\"quantiles\":[";
+        for (size_t i = 0; i < query->values.size(); i++) {
+            if (i > 0) out += ',';
+            AppendJSONNumber(out, query->values[i]);
+        }
+        out += "]}";
+        return true;
+    }
+
+    // Two bounds of up to 24 characters each on top of a bucket
+    out.reserve(128 + decoder.MaxBucketsLeft() * (MAX_BUCKET_CHARS + 48));
+    out += ",\"buckets\":[";
+
+    double gamma = metadata.gamma;
+    Decoder reader = decoder;
+    bool first = true;
+    while (!reader.Empty()) {
+        auto bucket = reader.ReadBucket();
+        if (!bucket) return false;
+
+        if (!first) out += ',';
+        out += '[';
+        AppendJSONNumber(out, std::pow(gamma, (double) bucket.value().key - 1));
+        out += ',';
+        AppendJSONNumber(out, std::pow(gamma, (double) bucket.value().key));
+        out += ',';
+        AppendNumber(out, bucket.value().count);
+        out += ']';
+        first = false;
+    }
+    out += "]}";
+
+    return !first;
+}
+
+bool Accumulator::Merge(const char *in, size_t length) {
+    StatsTimer timer = {Stats::MERGE_NS};
+    Decoder decoder = {in, length};
+
+    auto in_metadata = decoder.ReadMetadata();
+    if (!in_metadata) return CountDecoded(length, false);
+
+    if (!MergeMetadata(in_metadata.value())) return CountDecoded(length, false);
+
+    unsigned long long buckets = 0;
+    while (!decoder.Empty()) {
+        auto bucket = decoder.ReadBucket();
+        if (!bucket) return CountDecoded(length, false);
+
+        auto key = bucket.value().key;
+        Add(key, bucket.value().count);
+        buckets += 1 + decoder.span_left;
+
+        // The rest of a span is added straight into the window
+        if (decoder.span_left) {
+            Add(key + decoder.span_left, 0);
+            if (!decoder.ReadSpanCounts(&counts[key + 1 - base])) return CountDecoded(length, false);
+        }
+    }
+
+    return CountDecoded(length, !Empty(), buckets);
+}
+
+bool Accumulator::Merge(const Sketch &sketch) {
+    if (!MergeMetadata(sketch.metadata)) return false;
+
+    for (auto bucket: sketch.buckets) {
+        Add(bucket.key, bucket.count);
+    }
+
+    return !Empty();
+}
+
+// Merges a serialized sketch with a gamma up to gamma, remapping its buckets
+// onto gamma if it is finer (see GammaRemapper)
+bool Accumulator::Merge(const char *in, size_t length, float gamma) {
+    Decoder decoder = {in, length};
+
+    auto in_metadata = decoder.ReadMetadata();
+    if (!in_metadata) return CountDecoded(length, false);
+
+    if (in_metadata.value().gamma == gamma) {
+        return Merge(in, length);
+    }
+    if (in_metadata.value().gamma > gamma) {
+        return CountDecoded(length, false);
+    }
+
+    StatsTimer timer = {Stats::MERGE_NS};
+    GammaRemapper remapper(in_metadata.value().gamma, gamma);
+    in_metadata.value().gamma = gamma;
+    if (!MergeMetadata(in_metadata.value())) return CountDecoded(length, false);
+
+    unsigned long long buckets = 0;
+    while (!decoder.Empty()) {
+        auto bucket = decoder.ReadBucket();
+        if (!bucket) return CountDecoded(length, false);
+
+        for (auto remapped: remapper.Remap(bucket.value())) {
+            if (remapped.count) Add(remapped.key, remapped.count);
+        }
+        buckets++;
+    }
+
+    return CountDecoded(length, !Empty(), buckets);
+}
+
+// Adds the metadata and buckets of another accumulator, as if the sketches
+// merged into other had been merged into this one
+bool Accumulator::Merge(const Accumulator &other) {
+    if (!other.metadata) return true;
+    if (!MergeMetadata(other.metadata.value())) return false;
+    if (other.Empty()) return true;
+
+    // Grow the window to cover other's keys up front
+    Add(other.min_key, 0);
+    Add(other.max_key, 0);
+
+    kernels.add_counts(&counts[other.min_key - base], &other.counts[other.min_key - other.base],
+                       other.max_key - other.min_key + 1);
+
+    return true;
+}
+
+// Fewest sketches worth handing to a worker thread of MergeMany
+static const size_t MIN_SKETCHES_PER_THREAD = 256;
+
+/*
+ * Merges many serialized sketches, the same as calling Merge on each in order,
+ * using up to threads worker threads (0 for one per core). Each worker merges
+ * a contiguous range of sketches into a private accumulator, then neighbouring
+ * partial results are combined pairwise in a tree until one is left, which is
+ * merged into this accumulator.
+ *
+ * Bucket counts and the total count are integers, so the tree gives exactly
+ * the sequential result. The float sum isn't associative, so it is summed in
+ * order from the per-sketch sums at the end. Returns false if any sketch is
+ * invalid or can't be merged, in which case the accumulator is left in an
+ * unspecified state (as it is after a failed Merge).
+ */
+bool Accumulator::MergeMany(const std::vector<std::string_view> &sketches, unsigned int threads) {
+    if (threads == 0) {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    size_t workers = std::min<size_t>(threads, std::max<size_t>(1, sketches.size() / MIN_SKETCHES_PER_THREAD));
+
+    if (workers == 1) {
+        for (auto sketch: sketches) {
+            if (!Merge(sketch.data(), sketch.size())) return false;
+        }
+        return true;
+    }
+
+    std::vector<Accumulator> partials(workers);
+    std::vector<float> sums(sketches.size());
+    std::vector<char> failed(workers, false);
+
+    std::vector<std::thread> pool;
+    for (size_t w = 0; w < workers; w++) {
+        pool.emplace_back([&, w] {
+            size_t begin = sketches.size() * w / workers;
+            size_t end = sketches.size() * (w + 1) / workers;
+
+            for (size_t i = begin; i < end; i++) {
+                auto sketch = sketches[i];
+                if (!partials[w].Merge(sketch.data(), sketch.size())) {
+                    failed[w] = true;
+                    return;
+                }
+                sums[i] = Metadata::Deserialize(sketch.data(), sketch.size()).value().sum;
+            }
+        });
+    }
+    for (auto &thread: pool) {
+        thread.join();
+    }
+    if (std::find(failed.begin(), failed.end(), true) != failed.end()) {
+        return false;
+    }
+
+    // Combine partials[i] and partials[i + step] in place, doubling step each
+    // round, so partials[0] ends up with everything
+    for (size_t step = 1; step < workers; step *= 2) {
+        pool.clear();
+        for (size_t i = 0; i + step < workers; i += 2 * step) {
+            pool.emplace_back([&, i, step] {
+                failed[i] = !partials[i].Merge(partials[i + step]);
+            });
+        }
+        for (auto &thread: pool) {
+            thread.join();
+        }
+        if (std::find(failed.begin(), failed.end(), true) != failed.end()) {
+            return false;
+        }
+    }
+
+    auto sum = metadata ? metadata.value().sum : sums[0];
+    for (size_t i = metadata ? 0 : 1; i < sums.size(); i++) {
+        sum += sums[i];
+    }
+
+    if (!Merge(partials[0])) return false;
+    metadata.value().sum = sum;
+
+    return true;
+}
+
+// Checks that in can be merged with what has been merged so far and adds its
+// sum and count
+bool Accumulator::MergeMetadata(const Metadata &in) {
+    if (!metadata) {
+        metadata = in;
+        return true;
+    }
+
+    if (!metadata.value().Mergeable(in)) {
+        return false;
+    }
+
+    metadata.value().sum += in.sum;
+    metadata.value().count += in.count;
+    return true;
+}
+
+void Accumulator::Add(unsigned short key, unsigned long long count) {
+    if (key < base || (size_t) (key - base) >= counts.size()) {
+        Grow(key);
+    }
+
+    counts[key - base] += count;
+
+    if (key < min_key) min_key = key;
+    if (key > max_key) max_key = key;
+}
+
+// Extends the window so that it covers key. The window at least doubles in
+// size on each growth (towards the side that needed it) so that a run of
+// sketches with increasing or decreasing keys doesn't reallocate every time.
+void Accumulator::Grow(unsigned short key) {
+    if (counts.empty()) {
+        base = key;
+        counts.resize(std::min<size_t>(64, USHRT_MAX - key + 1));
+        Stats::Peak(counts.size() * sizeof(counts[0]));
+        return;
+    }
+
+    size_t lo = base;
+    size_t hi = base + counts.size(); // exclusive
+    size_t width = std::max<size_t>(counts.size() * 2, 64);
+
+    if (key < lo) {
+        lo = std::min<size_t>(key, hi > width ? hi - width : 0);
+    } else {
+        hi = std::max<size_t>(key + 1, std::min<size_t>(lo + width, USHRT_MAX + 1));
+    }
+
+    std::vector<unsigned long long> grown(hi - lo);
+    std::copy(counts.begin(), counts.end(), grown.begin() + (base - lo));
+
+    counts.swap(grown);
+    base = lo;
+    Stats::Peak(counts.size() * sizeof(counts[0]));
+}
+
+/*
+ * Bounds the sketch to at most max_buckets buckets by folding the lowest
+ * buckets into the lowest bucket that is kept (the collapsing DDSketch from
+ * the paper). Only quantiles that fall in the collapsed bucket are affected:
+ * their estimate is raised to that bucket's value. Any quantile q with
+ * q * count greater than the collapsed bucket's cumulative count stays
+ * alpha-accurate, so the upper quantiles keep their guarantee.
+ */
+void Accumulator::Collapse(size_t max_buckets) {
+    if (Empty() || max_buckets == 0) return;
+
+    // Find the lowest key to keep, counting non-empty buckets down from the top
+    size_t kept = 0;
+    size_t key = max_key;
+    for (;; key--) {
+        if (counts[key - base] && ++kept == max_buckets) break;
+        if (key == min_key) return; // already within bounds
+    }
+
+    unsigned long long folded = 0;
+    for (size_t low = min_key; low < key; low++) {
+        folded += counts[low - base];
+        counts[low - base] = 0;
+    }
+
+    counts[key - base] += folded;
+    min_key = key;
+}
+
+bool Accumulator::Empty() const {
+    return min_key > max_key;
+}
+
+std::vector<Bucket> Accumulator::Buckets() const {
+    std::vector<Bucket> ordered;
+    if (Empty()) return ordered;
+
+    auto first = counts.begin() + (min_key - base);
+    auto last = counts.begin() + (max_key - base + 1);
+    ordered.reserve(last - first - std::count(first, last, 0));
+
+    for (size_t key = min_key; key <= max_key; key++) {
+        auto count = counts[key - base];
+        if (count) {
+            ordered.push_back({.key = (unsigned short) key, .count = count});
+        }
+    }
+
+    // As for #begin, the first of only empty buckets is kept
+    if (ordered.empty()) ordered.push_back({.key = min_key, .count = 0});
+
+    return ordered;
+}
+
+Sketch Accumulator::ToSketch() const {
+    return {
+            .metadata = metadata.value(),
+            .buckets = Buckets(),
+    };
+}
+
+Accumulator::Iterator Accumulator::begin() const {
+    if (Empty()) return end();
+
+    // A window of only empty buckets still has its first one, so that the
+    // serialized sketch has a bucket and stays valid
+    Iterator it = {.acc = this, .key = min_key};
+    if (counts[min_key - base] == 0) {
+        ++it;
+        if (it.key > max_key) it.key = min_key;
+    }
+
+    return it;
+}
+
+Accumulator::Iterator Accumulator::end() const {
+    return {.acc = this, .key = Empty() ? (size_t) 0 : (size_t) max_key + 1};
+}
+
+// Serializes straight from the touched window, the same as
+// ToSketch().SerializedSize() but without building a bucket vector.
+size_t Accumulator::SerializedSize() const {
+    return ::SerializedSize(metadata.value(), *this);
+}
+
+char *Accumulator::SerializeTo(char *out) const {
+    return SerializeBuckets(out, metadata.value(), *this);
+}
+
+// Walks the touched window directly, so quantiles of an aggregated sketch
+// don't need ToSketch or a serialization round trip.
+void Accumulator::Quantiles(QuantileQuery &query) const {
+    query.Start(metadata.value());
+
+    // Skips to the bucket reaching each rank, and adds it with the counts
+    // skipped over. Ranks at or below the count so far (q = 0) are reached
+    // by the next non-empty bucket, as they are when adding every bucket.
+    if (!Empty()) {
+        const auto *window = &counts[min_key - base];
+        size_t size = max_key - min_key + 1;
+        size_t i = 0;
+        unsigned long long cuml_count = 0;
+        while (query.next < query.order.size()) {
+            auto rank = std::max(query.ranks[query.next], cuml_count + 1);
+            i += kernels.find_rank(window + i, size - i, cuml_count, rank);
+            if (i == size) break;
+
+            query.Add({.key = (unsigned short) (min_key + i), .count = cuml_count - query.cuml_count});
+            i++;
+        }
+
+        // Quantiles past the last bucket get its value
+        if (query.next < query.order.size()) {
+            size_t last = size;
+            while (last > 0 && window[last - 1] == 0) last--;
+            if (last > 0) {
+                query.Add({.key = (unsigned short) (min_key + last - 1), .count = cuml_count - query.cuml_count});
+            }
+        }
+    }
+
+    query.Finish();
+}
+
+void Accumulator::Clear() {
+    metadata.reset();
+
+    if (!Empty()) {
+        std::fill(counts.begin() + (min_key - base), counts.begin() + (max_key - base + 1), 0ULL);
+    }
+
+    min_key = USHRT_MAX;
+    max_key = 0;
+}
+
+// Returns false if any sketch is invalid, the gammas differ or the first
+// sketch isn't version 1
+bool StreamingMerge::Merge(const std::vector<std::string_view> &sketches, std::string &out) {
+    StatsTimer timer = {Stats::MERGE_NS};
+    decoders.clear();
+    heads.clear();
+
+    std::optional<Metadata> metadata;
+    for (auto sketch: sketches) {
+        decoders.emplace_back(sketch.data(), sketch.size());
+        auto in_metadata = decoders.back().ReadMetadata();
+        if (!in_metadata || decoders.back().Empty()) return CountDecoded(sketch.size(), false);
+
+        if (!metadata) {
+            metadata = in_metadata;
+        } else if (!metadata.value().Mergeable(in_metadata.value())) {
+            return CountDecoded(sketch.size(), false);
+        } else {
+            metadata.value().sum += in_metadata.value().sum;
+            metadata.value().count += in_metadata.value().count;
+        }
+
+        heads.push_back(decoders.back().ReadBucket());
+        if (!heads.back()) return CountDecoded(sketch.size(), false);
+    }
+    if (!metadata || metadata.value().version != 1) return false;
+
+    // Room for the metadata, then grown as buckets are written
+    out.resize(std::max<size_t>(out.size(), Sketch::MetadataSize(metadata.value()) + 64));
+    size_t length = Sketch::WriteMetadata(out.data(), metadata.value()) - out.data();
+
+    // A bucket is written once every input is past its key, since an input
+    // may repeat a key (a zero delta). Empty buckets are dropped, as they are
+    // by an Accumulator, unless every bucket is empty, when the first one is
+    // kept so the output is still a valid sketch.
+    size_t metadata_size = length;
+    unsigned short prev_key = 0;
+    auto write_bucket = [&](const Bucket &bucket) {
+        // Two varints of at most 10 bytes
+        if (out.size() < length + 20) out.resize(std::max(out.size() * 2, length + 20));
+        char *pos = Sketch::WriteVarint(out.data() + length, bucket.key - prev_key);
+        pos = Sketch::WriteVarint(pos, bucket.count);
+        length = pos - out.data();
+        prev_key = bucket.key;
+    };
+
+    std::optional<Bucket> pending;
+    std::optional<unsigned short> first_key;
+    unsigned long long buckets = 0;
+    while (true) {
+        std::optional<unsigned short> key;
+        for (auto &head: heads) {
+            if (head && (!key || head.value().key < key.value())) key = head.value().key;
+        }
+
+        if (pending && (!key || key.value() != pending.value().key) && pending.value().count) {
+            write_bucket(pending.value());
+        }
+        if (!key) break;
+        if (!pending || pending.value().key != key.value()) pending = Bucket{.key = key.value(), .count = 0};
+        if (!first_key) first_key = key;
+
+        for (size_t i = 0; i < heads.size(); i++) {
+            if (!heads[i] || heads[i].value().key != key.value()) continue;
+
+            pending.value().count += heads[i].value().count;
+            buckets++;
+            if (decoders[i].Empty()) {
+                heads[i].reset();
+            } else {
+                heads[i] = decoders[i].ReadBucket();
+                if (!heads[i]) return CountDecoded(sketches[i].size(), false);
+            }
+        }
+    }
+    if (length == metadata_size) write_bucket({.key = first_key.value(), .count = 0});
+    out.resize(length);
+
+    for (auto sketch: sketches) {
+        CountDecoded(sketch.size(), true);
+    }
+    Stats::Add(Stats::BUCKETS_MERGED, buckets);
+    Stats::Add(Stats::OUTPUT_BYTES, length);
+
+    return true;
+}
+
+// Counters of the threads assigned to a shard, on their own cache line
+struct alignas(64) StatsShard {
+    std::array<std::atomic<unsigned long long>, Stats::COUNTERS> counters{};
+};
+
+// Threads are assigned shards round robin, so shards are only shared once
+// there are more threads than shards
+static const size_t STATS_SHARDS = 64;
+
+static std::mutex stats_mutex;
+static std::array<StatsShard, STATS_SHARDS> stats_shards;
+static std::atomic<unsigned int> stats_next_shard{0};
+static std::array<unsigned long long, Stats::COUNTERS> stats_baseline{};
+static std::atomic<unsigned long long> stats_peak{0};
+
+// Plain pointers and ints, so the thread locals need no guard or destructor
+// (which a dlopened library shouldn't register), and initial-exec, as the
+// library is built with -ftls-model=local-exec which can't be used for a
+// shared object's variables
+__attribute__((tls_model("initial-exec"))) static thread_local StatsShard *stats_local_shard = nullptr;
+__attribute__((tls_model("initial-exec"))) static thread_local unsigned int stats_calls = 0; // for sampling timers
+
+static StatsShard &LocalStatsShard() {
+    if (!stats_local_shard) {
+        stats_local_shard = &stats_shards[stats_next_shard.fetch_add(1, std::memory_order_relaxed) % STATS_SHARDS];
+    }
+    return *stats_local_shard;
+}
+
+void Stats::Add(Counter counter, unsigned long long n) {
+    LocalStatsShard().counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+// Peaks are rare (an accumulator growing past the largest seen so far), so
+// they go straight to a shared maximum
+void Stats::Peak(unsigned long long accumulator_bytes) {
+    auto peak = stats_peak.load(std::memory_order_relaxed);
+    while (accumulator_bytes > peak && !stats_peak.compare_exchange_weak(peak, accumulator_bytes)) {}
+}
+
+bool Stats::SampleTime() {
+    return stats_calls++ % TIME_SAMPLE_PERIOD == 0;
+}
+
+// Totals since the library was loaded, without the baseline
+static std::array<unsigned long long, Stats::COUNTERS> RawStatsTotals() {
+    std::array<unsigned long long, Stats::COUNTERS> totals{};
+    for (auto &shard: stats_shards) {
+        for (size_t i = 0; i < Stats::COUNTERS; i++) {
+            totals[i] += shard.counters[i].load(std::memory_order_relaxed);
+        }
+    }
+    return totals;
+}
+
+std::array<unsigned long long, Stats::COUNTERS> Stats::Totals() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+
+    auto totals = RawStatsTotals();
+    for (size_t i = 0; i < COUNTERS; i++) {
+        totals[i] -= stats_baseline[i];
+    }
+    return totals;
+}
+
+unsigned long long Stats::PeakAccumulatorBytes() {
+    return stats_peak.load(std::memory_order_relaxed);
+}
+
+void Stats::Reset() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats_baseline = RawStatsTotals();
+    stats_peak.store(0, std::memory_order_relaxed);
+}
+
+std::string Stats::JSON() {
+    static const char *names[COUNTERS] = {
+            "sketches_decoded",
+            "bytes_decoded",
+            "buckets_merged",
+            "decode_failures",
+            "output_bytes",
+            "merge_ns",
+            "serialize_ns",
+    };
+
+    auto totals = Totals();
+    std::string out = "{";
+    for (size_t i = 0; i < COUNTERS; i++) {
+        out += "\"" + std::string(names[i]) + "\":" + std::to_string(totals[i]) + ",";
+    }
+    out += "\"peak_accumulator_bytes\":" + std::to_string(PeakAccumulatorBytes()) + "}";
+    return out;
+}
+
+// Size of the result buffer MySQL preallocates for string functions
+static const size_t RESULT_BUFFER_SIZE = 255;
+
+/*
+ * Serializes an Accumulator (or Sketch) as a string function result. Small
+ * sketches are written into MySQL's preallocated result buffer, larger ones
+ * into buffer, which is kept per UDF_INIT so it only grows a few times.
+ */
+template<typename T>
+static char *serialize_result(const T &sketch, char *result, std::string &buffer, unsigned long *length) {
+    StatsTimer timer = {Stats::SERIALIZE_NS};
+    auto size = sketch.SerializedSize();
+    Stats::Add(Stats::OUTPUT_BYTES, size);
+
+    char *out = result;
+    if (size > RESULT_BUFFER_SIZE) {
+        buffer.resize(size);
+        out = buffer.data();
+    }
+
+    sketch.SerializeTo(out);
+    *length = size;
+
+    return out;
+}
+
+extern "C" [[maybe_unused]] bool dds_inspect_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
+        strcpy(message, "Requires exactly one sketch argument");
+        return true;
+    }
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new std::string()));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *dds_inspect(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length,
+                                              unsigned char *is_null, char *error) {
+    if (!args->args[0]) {
+        return nullptr;
+    }
+
+    auto sketch = SketchView::Deserialize(args->args[0], args->lengths[0]);
+
+    if (!sketch || !sketch.value().Valid()) {
+        *error = 1;
+        return nullptr;
+    }
+
+    auto *out = static_cast<std::string *>(static_cast<void *>(initid->ptr));
+    sketch.value().Inspect(*out);
+
+    *length = out->length();
+    *is_null = 0;
+
+    return out->data();
+}
+extern "C" [[maybe_unused]] void dds_inspect_deinit(UDF_INIT *initid) {
+    delete static_cast<std::string *>(static_cast<void *>(initid->ptr));
+}
+
+// Default accuracy of sketches built by dds_build, the same as ruby/sketch.rb
+static const double DEFAULT_ALPHA = 0.01;
+
+static bool valid_alpha(double alpha) {
+    return alpha > 0 && alpha < 1 && (float) KeyMapper::Gamma(alpha) > 1.0f;
+}
+
+struct Sum_Data {
+    Accumulator acc;
+    std::string serialized;
+    long long max_buckets = 0;
+    float gamma = 0; // target gamma, 0 to keep the gamma of the sketches
+    bool set = false;
+};
+
+// Checks the optional max bucket count argument at index i (the last
+// argument of dds_sum and dds_merge) and tells mysql to cast it to an int.
+static bool max_buckets_init(UDF_ARGS *args, unsigned int i) {
+    if (args->arg_count <= i) {
+        return true;
+    }
+    if (args->arg_count != i + 1 || (args->arg_type[i] != INT_RESULT && args->arg_type[i] != REAL_RESULT &&
+                                     args->arg_type[i] != DECIMAL_RESULT)) {
+        return false;
+    }
+
+    args->arg_type[i] = INT_RESULT;
+    return true;
+}
+
+// Reads the optional max bucket count at index i. Nothing (no limit) if it
+// isn't given, 0 if it is null or not positive.
+static std::optional<long long> max_buckets_arg(UDF_ARGS *args, unsigned int i) {
+    if (args->arg_count <= i) return {};
+    if (args->args[i] == nullptr) return 0;
+
+    auto max_buckets = *((long long *) args->args[i]);
+    return max_buckets > 0 ? max_buckets : 0;
+}
+
+extern "C" [[maybe_unused]] bool dds_sum_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count < 1 || args->arg_type[0] != STRING_RESULT || !max_buckets_init(args, 1)) {
+        strcpy(message, "Requires a sketch argument and an optional max bucket count");
+        return true;
+    }
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new Sum_Data()));
+
+    return false;
+}
+
+// Adds a row of dds_sum or dds_sum_convert, whose max bucket count is at
+// index max_buckets_arg_index, converted to data->gamma if it is set
+static void sum_add(Sum_Data *data, UDF_ARGS *args, unsigned int max_buckets_arg_index, char *error) {
+    auto max_buckets = max_buckets_arg(args, max_buckets_arg_index);
+    if (max_buckets) {
+        if (max_buckets.value() == 0) {
+            *error = true;
+            return;
+        }
+        data->max_buckets = max_buckets.value();
+    }
+
+    DDS_PROBE1(sum_add_entry, args->lengths[0]);
+    auto success = data->gamma > 0 ? data->acc.Merge(args->args[0], args->lengths[0], data->gamma)
+                                   : data->acc.Merge(args->args[0], args->lengths[0]);
+    DDS_PROBE1(sum_add_return, success);
+    if (!success) {
+        *error = true;
+        return;
+    }
+
+    data->set = true;
+}
+
+extern "C" [[maybe_unused]] void dds_sum_add(UDF_INIT *initid, UDF_ARGS *args, char *, char *error) {
+    if (args->args[0] == nullptr) {
+        return;
+    }
+
+    sum_add(static_cast<Sum_Data *>(static_cast<void *>(initid->ptr)), args, 1, error);
+}
+
+extern "C" [[maybe_unused]] void dds_sum_clear(UDF_INIT *initid, char *, char *) {
+    auto *data = static_cast<Sum_Data *>(static_cast<void *>(initid->ptr));
+
+    data->acc.Clear();
+    data->set = false;
+}
+
+extern "C" [[maybe_unused]] char *
 dds_sum(UDF_INIT *initid, UDF_ARGS *, char *result, unsigned long *length, char *is_null, char *) {
     auto *data = static_cast<Sum_Data *>(static_cast<void *>(initid->ptr));
 
@@ -410,172 +2348,1337 @@ dds_sum(UDF_INIT *initid, UDF_ARGS *, char *result, unsigned long *length, char
         return result;
     }
 
-    data->serialized = data->acc.ToSketch().Serialize();
+    DDS_PROBE1(sum_entry, data->acc.counts.size());
+    if (data->max_buckets > 0) {
+        data->acc.Collapse(data->max_buckets);
+    }
+
+    *is_null = 0;
+
+    auto *out = serialize_result(data->acc, result, data->serialized, length);
+    DDS_PROBE1(sum_return, *length);
+    return out;
+}
+
+extern "C" [[maybe_unused]] void dds_sum_deinit(UDF_INIT *initid) {
+    delete static_cast<Sum_Data *>(static_cast<void *>(initid->ptr));
+}
+
+extern "C" [[maybe_unused]] bool dds_sum_convert_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count < 2 || args->arg_type[0] != STRING_RESULT ||
+        (args->arg_type[1] != INT_RESULT && args->arg_type[1] != REAL_RESULT &&
+         args->arg_type[1] != DECIMAL_RESULT) || !max_buckets_init(args, 2)) {
+        strcpy(message, "Requires a sketch argument, a target alpha and an optional max bucket count");
+        return true;
+    }
+    args->arg_type[1] = REAL_RESULT;
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new Sum_Data()));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] void dds_sum_convert_add(UDF_INIT *initid, UDF_ARGS *args, char *, char *error) {
+    if (args->args[0] == nullptr) {
+        return;
+    }
+
+    auto *data = static_cast<Sum_Data *>(static_cast<void *>(initid->ptr));
+
+    if (args->args[1] == nullptr || !valid_alpha(*((double *) args->args[1]))) {
+        *error = true;
+        return;
+    }
+    data->gamma = (float) KeyMapper::Gamma(*((double *) args->args[1]));
+
+    sum_add(data, args, 2, error);
+}
+
+extern "C" [[maybe_unused]] void dds_sum_convert_clear(UDF_INIT *initid, char *is_null, char *error) {
+    dds_sum_clear(initid, is_null, error);
+}
+
+extern "C" [[maybe_unused]] char *
+dds_sum_convert(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error) {
+    return dds_sum(initid, args, result, length, is_null, error);
+}
+
+extern "C" [[maybe_unused]] void dds_sum_convert_deinit(UDF_INIT *initid) {
+    dds_sum_deinit(initid);
+}
+
+/*
+ * MySQL passes the value of constant arguments to the init functions (and
+ * nullptr for everything else). Constants are still in their original type
+ * at that point, before any arg_type coercion requested by init takes effect.
+ */
+static std::optional<double> const_real_arg(UDF_ARGS *args, unsigned int i) {
+    if (args->args[i] == nullptr) return {};
+
+    switch (args->arg_type[i]) {
+        case REAL_RESULT:
+            return *((double *) args->args[i]);
+        case INT_RESULT:
+            return (double) *((long long *) args->args[i]);
+        case DECIMAL_RESULT: {
+            char buf[128];
+            size_t length = std::min<size_t>(args->lengths[i], sizeof(buf) - 1);
+            memcpy(buf, args->args[i], length);
+            buf[length] = 0;
+            return strtod(buf, nullptr);
+        }
+        default:
+            return {};
+    }
+}
+
+struct Build_Data {
+    std::optional<double> const_alpha; // constant alpha argument
+    std::optional<KeyMapper> mapper;
+    double alpha = 0;
+    Accumulator acc;
+    double sum = 0;
+    unsigned long long count = 0;
+    std::string serialized;
+};
+
+extern "C" [[maybe_unused]] bool dds_build_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count < 1 || args->arg_count > 2) {
+        strcpy(message, "Requires a value and an optional alpha");
+        return true;
+    }
+    for (unsigned int i = 0; i < args->arg_count; i++) {
+        if (args->arg_type[i] != REAL_RESULT && args->arg_type[i] != INT_RESULT &&
+            args->arg_type[i] != DECIMAL_RESULT) {
+            strcpy(message, "Arguments must be numeric");
+            return true;
+        }
+    }
+    // A constant alpha is checked and kept up front, read before the coercion
+    // below
+    auto alpha = args->arg_count == 2 ? const_real_arg(args, 1) : std::nullopt;
+    if (alpha && !valid_alpha(alpha.value())) {
+        strcpy(message, "Alpha must be between 0 and 1");
+        return true;
+    }
+    for (unsigned int i = 0; i < args->arg_count; i++) {
+        args->arg_type[i] = REAL_RESULT;
+    }
+
+    auto *data = new Build_Data();
+    data->const_alpha = alpha;
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(data));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] void dds_build_add(UDF_INIT *initid, UDF_ARGS *args, char *, char *error) {
+    if (args->args[0] == nullptr) {
+        return;
+    }
+
+    auto *data = static_cast<Build_Data *>(static_cast<void *>(initid->ptr));
+
+    double alpha = DEFAULT_ALPHA;
+    if (data->const_alpha) {
+        alpha = data->const_alpha.value();
+    } else if (args->arg_count == 2) {
+        if (args->args[1] == nullptr || !valid_alpha(*((double *) args->args[1]))) {
+            *error = true;
+            return;
+        }
+        alpha = *((double *) args->args[1]);
+    }
+
+    // The mapper (and its table of bucket bounds) is kept across groups
+    if (!data->mapper || data->alpha != alpha) {
+        if (data->count > 0) {
+            *error = true; // alpha changed within a group
+            return;
+        }
+        data->mapper.emplace(KeyMapper::Gamma(alpha));
+        data->alpha = alpha;
+    }
+
+    double value = *((double *) args->args[0]);
+    auto key = data->mapper.value().Key(value);
+    if (!key) {
+        *error = true;
+        return;
+    }
+
+    data->acc.Add(key.value(), 1);
+    data->sum += value;
+    data->count++;
+}
+
+extern "C" [[maybe_unused]] void dds_build_clear(UDF_INIT *initid, char *, char *) {
+    auto *data = static_cast<Build_Data *>(static_cast<void *>(initid->ptr));
+
+    data->acc.Clear();
+    data->sum = 0;
+    data->count = 0;
+}
+
+extern "C" [[maybe_unused]] char *
+dds_build(UDF_INIT *initid, UDF_ARGS *, char *result, unsigned long *length, char *is_null, char *) {
+    auto *data = static_cast<Build_Data *>(static_cast<void *>(initid->ptr));
+
+    if (data->count == 0) {
+        *is_null = true;
+        return result;
+    }
+
+    data->acc.metadata = Metadata{
+            .version = 1,
+            .sum = (float) data->sum,
+            .count = data->count,
+            .gamma = (float) data->mapper.value().gamma,
+    };
+    *is_null = 0;
+
+    return serialize_result(data->acc, result, data->serialized, length);
+}
+
+extern "C" [[maybe_unused]] void dds_build_deinit(UDF_INIT *initid) {
+    delete static_cast<Build_Data *>(static_cast<void *>(initid->ptr));
+}
+
+struct Quantile_Data {
+    std::optional<double> q;
+    bool const_sketch = false;
+    std::string const_bytes; // constant sketch argument
+    std::optional<Sketch> sketch; // decoded constant sketch, if it is valid
+    ValueTable values;
+};
+
+extern "C" [[maybe_unused]] bool dds_quantile_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 2) {
+        strcpy(message, "Requires exactly two arguments");
+        return true;
+    }
+    if (args->arg_type[0] != REAL_RESULT && args->arg_type[0] != INT_RESULT && args->arg_type[0] != DECIMAL_RESULT) {
+        strcpy(message, "First argument must be a numeric quantile");
+        return true;
+    }
+    if (args->arg_type[1] != STRING_RESULT) {
+        strcpy(message, "Second argument must be a sketch");
+        return true;
+    }
+
+    auto *data = new Quantile_Data();
+    data->q = const_real_arg(args, 0);
+    if (args->args[1]) {
+        data->const_sketch = true;
+        data->const_bytes.assign(args->args[1], args->lengths[1]);
+        auto sketch = Sketch::Deserialize(args->args[1], args->lengths[1]);
+        if (sketch) {
+            data->sketch.emplace(sketch.value());
+            data->sketch.value().BuildIndex();
+        }
+    }
+
+    // Tell mysql to cast the quantile to a double
+    args->arg_type[0] = REAL_RESULT;
+
+    initid->maybe_null = true;
+    initid->ptr = static_cast<char *>(static_cast<void *>(data));
+    return false;
+}
+
+extern "C" [[maybe_unused]] double dds_quantile(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
+    auto *data = static_cast<Quantile_Data *>(static_cast<void *>(initid->ptr));
+
+    // Every return fires quantile_return with whether there is a value, to
+    // pair with quantile_entry
+    DDS_PROBE2(quantile_entry, args->lengths[1], data->const_sketch);
+    if (args->args[0] == nullptr || args->args[1] == nullptr) {
+        DDS_PROBE1(quantile_return, false);
+        *is_null = true;
+        return 0.0;
+    }
+
+    double q = data->q ? data->q.value() : *((double *) args->args[0]);
+
+    if (data->sketch) {
+        auto &sketch = data->sketch.value();
+        auto value = data->values.Value(sketch.metadata, sketch.QuantileKey(q));
+        DDS_PROBE1(quantile_return, true);
+        return value;
+    }
+
+    // A constant sketch that isn't fully valid is read the same way as a row's
+    // sketch, so quantiles before an invalid bucket still have a value
+    auto sketch = data->const_sketch ? SketchView::Deserialize(data->const_bytes.data(), data->const_bytes.size())
+                                     : SketchView::Deserialize(args->args[1], args->lengths[1]);
+    if (!sketch) {
+        DDS_PROBE1(quantile_return, false);
+        *is_null = true;
+        return 0.0;
+    }
+
+    auto key = sketch.value().QuantileKey(q);
+    if (!key) {
+        DDS_PROBE1(quantile_return, false);
+        *is_null = true;
+        return 0.0;
+    }
+
+    auto value = data->values.Value(sketch.value().metadata, key.value());
+    DDS_PROBE1(quantile_return, true);
+    return value;
+}
+
+extern "C" [[maybe_unused]] void dds_quantile_deinit(UDF_INIT *initid) {
+    delete static_cast<Quantile_Data *>(static_cast<void *>(initid->ptr));
+}
+
+// Validates the quantile arguments of dds_quantiles and dds_sum_quantiles
+// (every argument after the sketch) and tells mysql to cast them to doubles.
+// If every quantile is a constant they are read (and sorted) into query once
+// here and const_qs is set.
+static bool quantiles_init(UDF_ARGS *args, char *message, QuantileQuery &query, bool &const_qs) {
+    if (args->arg_count < 2) {
+        strcpy(message, "Requires a sketch and at least one quantile");
+        return true;
+    }
+    if (args->arg_type[0] != STRING_RESULT) {
+        strcpy(message, "First argument must be a sketch");
+        return true;
+    }
+
+    const_qs = true;
+    query.qs.resize(args->arg_count - 1);
+    for (unsigned int i = 1; i < args->arg_count; i++) {
+        if (args->arg_type[i] != REAL_RESULT && args->arg_type[i] != INT_RESULT &&
+            args->arg_type[i] != DECIMAL_RESULT) {
+            strcpy(message, "Quantile arguments must be numeric");
+            return true;
+        }
+
+        auto q = const_real_arg(args, i);
+        const_qs = const_qs && q.has_value();
+        query.qs[i - 1] = q.value_or(0.0);
+
+        args->arg_type[i] = REAL_RESULT;
+    }
+
+    if (const_qs) {
+        query.Sort();
+    }
+
+    return false;
+}
+
+// Reads the quantile arguments into query. Returns false if any is null.
+static bool quantiles_args(UDF_ARGS *args, QuantileQuery &query) {
+    query.qs.resize(args->arg_count - 1);
+    for (unsigned int i = 1; i < args->arg_count; i++) {
+        if (args->args[i] == nullptr) return false;
+        query.qs[i - 1] = *((double *) args->args[i]);
+    }
+
+    query.Sort();
+    return true;
+}
+
+struct Quantiles_Data {
+    QuantileQuery query;
+    bool const_qs = false;
+    std::string out;
+};
+
+extern "C" [[maybe_unused]] bool dds_quantiles_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    auto *data = new Quantiles_Data();
+    if (quantiles_init(args, message, data->query, data->const_qs)) {
+        delete data;
+        return true;
+    }
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(data));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *
+dds_quantiles(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length, unsigned char *is_null, char *) {
+    auto *data = static_cast<Quantiles_Data *>(static_cast<void *>(initid->ptr));
+
+    if (args->args[0] == nullptr || (!data->const_qs && !quantiles_args(args, data->query))) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    auto sketch = SketchView::Deserialize(args->args[0], args->lengths[0]);
+    if (!sketch || !sketch.value().Quantiles(data->query)) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    data->out.assign(data->query.JSON());
+    *length = data->out.length();
+    *is_null = 0;
+
+    return data->out.data();
+}
+
+extern "C" [[maybe_unused]] void dds_quantiles_deinit(UDF_INIT *initid) {
+    delete static_cast<Quantiles_Data *>(static_cast<void *>(initid->ptr));
+}
+
+struct Sum_Quantiles_Data {
+    Accumulator acc;
+    QuantileQuery query;
+    bool const_qs = false;
+    std::string out;
+    bool set = false;
+};
+
+extern "C" [[maybe_unused]] bool dds_sum_quantiles_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    auto *data = new Sum_Quantiles_Data();
+    if (quantiles_init(args, message, data->query, data->const_qs)) {
+        delete data;
+        return true;
+    }
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(data));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] void dds_sum_quantiles_add(UDF_INIT *initid, UDF_ARGS *args, char *, char *error) {
+    if (args->args[0] == nullptr) {
+        return;
+    }
+
+    auto *data = static_cast<Sum_Quantiles_Data *>(static_cast<void *>(initid->ptr));
+
+    // Quantiles are taken from the first non-null sketch row of each group
+    if (!data->set && !data->const_qs && !quantiles_args(args, data->query)) {
+        *error = true;
+        return;
+    }
+
+    if (!data->acc.Merge(args->args[0], args->lengths[0])) {
+        *error = true;
+        return;
+    }
+
+    data->set = true;
+}
+
+extern "C" [[maybe_unused]] void dds_sum_quantiles_clear(UDF_INIT *initid, char *, char *) {
+    auto *data = static_cast<Sum_Quantiles_Data *>(static_cast<void *>(initid->ptr));
+
+    data->acc.Clear();
+    data->set = false;
+}
+
+extern "C" [[maybe_unused]] char *
+dds_sum_quantiles(UDF_INIT *initid, UDF_ARGS *, char *result, unsigned long *length, char *is_null, char *) {
+    auto *data = static_cast<Sum_Quantiles_Data *>(static_cast<void *>(initid->ptr));
+
+    if (!data->set) {
+        *is_null = true;
+        return result;
+    }
+
+    data->acc.Quantiles(data->query);
+    data->out.assign(data->query.JSON());
+
+    *length = data->out.length();
+    *is_null = 0;
+
+    return data->out.data();
+}
+
+extern "C" [[maybe_unused]] void dds_sum_quantiles_deinit(UDF_INIT *initid) {
+    delete static_cast<Sum_Quantiles_Data *>(static_cast<void *>(initid->ptr));
+}
+
+// dds_sum_quantile(q, sketch) is dds_quantile(q, dds_sum(sketch)) answered from
+// the accumulator, like dds_sum_quantiles with a single quantile, and shares
+// its data
+extern "C" [[maybe_unused]] bool dds_sum_quantile_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 2) {
+        strcpy(message, "Requires exactly two arguments");
+        return true;
+    }
+    if (args->arg_type[0] != REAL_RESULT && args->arg_type[0] != INT_RESULT && args->arg_type[0] != DECIMAL_RESULT) {
+        strcpy(message, "First argument must be a numeric quantile");
+        return true;
+    }
+    if (args->arg_type[1] != STRING_RESULT) {
+        strcpy(message, "Second argument must be a sketch");
+        return true;
+    }
+
+    auto *data = new Sum_Quantiles_Data();
+    auto q = const_real_arg(args, 0);
+    if (q) {
+        data->const_qs = true;
+        data->query.Set(&q.value(), 1);
+    }
+
+    // Tell mysql to cast the quantile to a double
+    args->arg_type[0] = REAL_RESULT;
+
+    initid->maybe_null = true;
+    initid->ptr = static_cast<char *>(static_cast<void *>(data));
+    return false;
+}
+
+extern "C" [[maybe_unused]] void dds_sum_quantile_add(UDF_INIT *initid, UDF_ARGS *args, char *, char *error) {
+    if (args->args[1] == nullptr) {
+        return;
+    }
+
+    auto *data = static_cast<Sum_Quantiles_Data *>(static_cast<void *>(initid->ptr));
+
+    // The quantile is taken from the first non-null sketch row of each group
+    if (!data->set && !data->const_qs) {
+        if (args->args[0] == nullptr) {
+            *error = true;
+            return;
+        }
+        data->query.Set((double *) args->args[0], 1);
+    }
+
+    if (!data->acc.Merge(args->args[1], args->lengths[1])) {
+        *error = true;
+        return;
+    }
+
+    data->set = true;
+}
+
+extern "C" [[maybe_unused]] void dds_sum_quantile_clear(UDF_INIT *initid, char *, char *) {
+    auto *data = static_cast<Sum_Quantiles_Data *>(static_cast<void *>(initid->ptr));
+
+    data->acc.Clear();
+    data->set = false;
+}
+
+extern "C" [[maybe_unused]] double dds_sum_quantile(UDF_INIT *initid, UDF_ARGS *, unsigned char *is_null, unsigned char *) {
+    auto *data = static_cast<Sum_Quantiles_Data *>(static_cast<void *>(initid->ptr));
+
+    if (!data->set) {
+        *is_null = true;
+        return 0.0;
+    }
+
+    data->acc.Quantiles(data->query);
+    return data->query.values[0];
+}
+
+extern "C" [[maybe_unused]] void dds_sum_quantile_deinit(UDF_INIT *initid) {
+    delete static_cast<Sum_Quantiles_Data *>(static_cast<void *>(initid->ptr));
+}
+
+struct Merge_Data {
+    StreamingMerge merger;
+    std::vector<std::string_view> sketches; // non-null sketch arguments of the row
+    unsigned int sketch_count = 0; // arguments before the optional max bucket count
+    Accumulator acc;
+    std::string out;
+};
+
+extern "C" [[maybe_unused]] bool dds_merge_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    // A trailing non-sketch argument is the max bucket count
+    unsigned int sketch_count = args->arg_count;
+    if (sketch_count > 0 && args->arg_type[sketch_count - 1] != STRING_RESULT) sketch_count--;
+
+    bool valid = sketch_count >= 2 && max_buckets_init(args, sketch_count);
+    for (unsigned int i = 0; valid && i < sketch_count; i++) {
+        valid = args->arg_type[i] == STRING_RESULT;
+    }
+    if (!valid) {
+        strcpy(message, "Requires at least two sketch arguments and an optional max bucket count");
+        return true;
+    }
+
+    auto *data = new Merge_Data();
+    data->sketch_count = sketch_count;
+    data->sketches.reserve(sketch_count);
+
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(data));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *
+dds_merge(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, unsigned char *is_null,
+          char *error) {
+    auto *data = static_cast<Merge_Data *>(static_cast<void *>(initid->ptr));
+
+    // Null sketches are skipped
+    data->sketches.clear();
+    for (unsigned int i = 0; i < data->sketch_count; i++) {
+        if (args->args[i]) data->sketches.emplace_back(args->args[i], args->lengths[i]);
+    }
+    if (data->sketches.empty()) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    auto max_buckets = max_buckets_arg(args, data->sketch_count);
+    if (max_buckets && max_buckets.value() == 0) {
+        *error = true;
+        return nullptr;
+    }
+
+    // A single sketch is returned as is, unless it needs collapsing
+    if (data->sketches.size() == 1 && !max_buckets) {
+        for (unsigned int i = 0; i < data->sketch_count; i++) {
+            if (args->args[i]) {
+                *length = args->lengths[i];
+                return args->args[i];
+            }
+        }
+    }
+
+    // Version 1 sketches (the default) are merged without an accumulator,
+    // other versions and collapsed results go through one
+    if (!max_buckets && data->sketches[0].size() > 0 && data->sketches[0][0] == 1) {
+        if (!data->merger.Merge(data->sketches, data->out)) {
+            *error = true;
+            return nullptr;
+        }
+
+        *length = data->out.size();
+        *is_null = 0;
+        return data->out.data();
+    }
+
+    auto &acc = data->acc;
+    acc.Clear();
+    for (auto sketch: data->sketches) {
+        if (!acc.Merge(sketch.data(), sketch.size())) {
+            *error = true;
+            return nullptr;
+        }
+    }
+
+    if (max_buckets) {
+        acc.Collapse(max_buckets.value());
+    }
+
+    *is_null = 0;
+
+    return serialize_result(acc, result, data->out, length);
+}
+
+extern "C" [[maybe_unused]] void dds_merge_deinit(UDF_INIT *initid) {
+    delete static_cast<Merge_Data *>(static_cast<void *>(initid->ptr));
+}
+
+struct Collapse_Data {
+    Accumulator acc;
+    std::string out;
+};
+
+extern "C" [[maybe_unused]] bool dds_collapse_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 2 || args->arg_type[0] != STRING_RESULT || !max_buckets_init(args, 1)) {
+        strcpy(message, "Requires a sketch and a max bucket count");
+        return true;
+    }
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new Collapse_Data()));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *
+dds_collapse(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, unsigned char *is_null,
+             char *) {
+    auto max_buckets = max_buckets_arg(args, 1);
+    if (args->args[0] == nullptr || max_buckets.value_or(0) == 0) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    auto *data = static_cast<Collapse_Data *>(static_cast<void *>(initid->ptr));
+    data->acc.Clear();
+
+    if (!data->acc.Merge(args->args[0], args->lengths[0])) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    data->acc.Collapse(max_buckets.value());
+    *is_null = 0;
+
+    return serialize_result(data->acc, result, data->out, length);
+}
+
+extern "C" [[maybe_unused]] void dds_collapse_deinit(UDF_INIT *initid) {
+    delete static_cast<Collapse_Data *>(static_cast<void *>(initid->ptr));
+}
+
+extern "C" [[maybe_unused]] bool dds_convert_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 2 || args->arg_type[0] != STRING_RESULT || args->arg_type[1] != INT_RESULT) {
+        strcpy(message, "Requires a sketch and a version");
+        return true;
+    }
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new std::string()));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *
+dds_convert(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, unsigned char *is_null,
+            char *) {
+    if (args->args[0] == nullptr || args->args[1] == nullptr) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    auto version = *((long long *) args->args[1]);
+    auto sketch = SketchView::Deserialize(args->args[0], args->lengths[0]);
+    if (version < 1 || version > 3 || !sketch || !sketch.value().Valid()) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    // Re-encode straight from the view, without decoding into a Sketch first
+    auto metadata = sketch.value().metadata;
+    metadata.version = (unsigned char) version;
+
+    StatsTimer timer = {Stats::SERIALIZE_NS};
+    auto size = SerializedSize(metadata, sketch.value());
+    Stats::Add(Stats::OUTPUT_BYTES, size);
+    char *out = result;
+    if (size > RESULT_BUFFER_SIZE) {
+        auto *buffer = static_cast<std::string *>(static_cast<void *>(initid->ptr));
+        buffer->resize(size);
+        out = buffer->data();
+    }
+
+    SerializeBuckets(out, metadata, sketch.value());
+    *length = size;
+    *is_null = 0;
+
+    return out;
+}
+
+extern "C" [[maybe_unused]] void dds_convert_deinit(UDF_INIT *initid) {
+    delete static_cast<std::string *>(static_cast<void *>(initid->ptr));
+}
+
+struct Convert_Gamma_Data {
+    Accumulator acc;
+    std::string out;
+};
+
+extern "C" [[maybe_unused]] bool dds_convert_gamma_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 2 || args->arg_type[0] != STRING_RESULT ||
+        (args->arg_type[1] != REAL_RESULT && args->arg_type[1] != DECIMAL_RESULT && args->arg_type[1] != INT_RESULT)) {
+        strcpy(message, "Requires a sketch and an alpha");
+        return true;
+    }
+
+    // Tell mysql to cast the alpha to a double
+    args->arg_type[1] = REAL_RESULT;
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new Convert_Gamma_Data()));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *
+dds_convert_gamma(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, unsigned char *is_null,
+                  char *) {
+    if (args->args[0] == nullptr || args->args[1] == nullptr || !valid_alpha(*((double *) args->args[1]))) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    auto *data = static_cast<Convert_Gamma_Data *>(static_cast<void *>(initid->ptr));
+    data->acc.Clear();
+
+    auto gamma = (float) KeyMapper::Gamma(*((double *) args->args[1]));
+    if (!data->acc.Merge(args->args[0], args->lengths[0], gamma)) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    *is_null = 0;
+
+    return serialize_result(data->acc, result, data->out, length);
+}
+
+extern "C" [[maybe_unused]] void dds_convert_gamma_deinit(UDF_INIT *initid) {
+    delete static_cast<Convert_Gamma_Data *>(static_cast<void *>(initid->ptr));
+}
+
+extern "C" [[maybe_unused]] bool dds_mean_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
+        strcpy(message, "Requires exactly one sketch argument");
+        return true;
+    }
+
+    initid->maybe_null = true;
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] double dds_mean(UDF_INIT *, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
+    if (args->args[0] == nullptr) {
+        *is_null = true;
+        return 0.0;
+    }
+
+    auto metadata = Metadata::Deserialize(args->args[0], args->lengths[0]);
+    if (!metadata) {
+        *is_null = true;
+        return 0.0;
+    }
+
+    return metadata.value().Mean();
+}
+
+extern "C" [[maybe_unused]] bool dds_json_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
+        strcpy(message, "Requires exactly one sketch argument");
+        return true;
+    }
+
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new std::string()));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *dds_json(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length,
+                                              unsigned char *is_null, char *error) {
+    if (!args->args[0]) {
+        return nullptr;
+    }
+
+    auto sketch = SketchView::Deserialize(args->args[0], args->lengths[0]);
+
+    if (!sketch || !sketch.value().Valid()) {
+        *error = 1;
+        return nullptr;
+    }
+
+    auto *out = static_cast<std::string *>(static_cast<void *>(initid->ptr));
+    sketch.value().JSON(*out);
 
-    *length = data->serialized.length();
+    *length = out->length();
     *is_null = 0;
 
-    return data->serialized.data();
+    return out->data();
 }
 
-extern "C" [[maybe_unused]] void dds_sum_deinit(UDF_INIT *initid) {
-    delete static_cast<Sum_Data *>(static_cast<void *>(initid->ptr));
+extern "C" [[maybe_unused]] void dds_json_deinit(UDF_INIT *initid) {
+    delete static_cast<std::string *>(static_cast<void *>(initid->ptr));
 }
 
-extern "C" [[maybe_unused]] bool dds_quantile_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
-    if (args->arg_count != 2) {
-        strcpy(message, "Requires exactly two arguments");
-        return true;
-    }
-    if (args->arg_type[0] != REAL_RESULT && args->arg_type[0] != INT_RESULT && args->arg_type[0] != DECIMAL_RESULT) {
-        strcpy(message, "First argument must be a numeric quantile");
+struct Add_Data {
+    std::optional<KeyMapper> mapper; // for the gamma of the last sketch
+    std::string out;
+};
+
+extern "C" [[maybe_unused]] bool dds_add_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count < 2 || args->arg_count > 3 || args->arg_type[0] != STRING_RESULT) {
+        strcpy(message, "Requires a sketch, a value and an optional count");
         return true;
     }
-    if (args->arg_type[1] != STRING_RESULT) {
-        strcpy(message, "Second argument must be a sketch");
-        return true;
+    for (unsigned int i = 1; i < args->arg_count; i++) {
+        if (args->arg_type[i] != REAL_RESULT && args->arg_type[i] != INT_RESULT &&
+            args->arg_type[i] != DECIMAL_RESULT) {
+            strcpy(message, "Requires a sketch, a value and an optional count");
+            return true;
+        }
     }
 
-    // Tell mysql to cast the quantile to a double
-    args->arg_type[0] = REAL_RESULT;
+    // Tell mysql to cast the value to a double and the count to an integer
+    args->arg_type[1] = REAL_RESULT;
+    if (args->arg_count == 3) args->arg_type[2] = INT_RESULT;
 
     initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new Add_Data()));
+
     return false;
 }
 
-extern "C" [[maybe_unused]] double dds_quantile(UDF_INIT *, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
-    if (args->args[0] == nullptr || args->args[1] == nullptr) {
+extern "C" [[maybe_unused]] char *
+dds_add(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length, unsigned char *is_null, char *error) {
+    auto *data = static_cast<Add_Data *>(static_cast<void *>(initid->ptr));
+
+    if (args->args[0] == nullptr) {
         *is_null = true;
-        return 0.0;
+        return nullptr;
     }
 
-    auto sketch = Sketch::Deserialize(args->args[1], args->lengths[1]);
-    if (!sketch) {
+    // Like dds_merge with a null sketch, a null value leaves the sketch as it is
+    long long count = args->arg_count == 3 && args->args[2] ? *((long long *) args->args[2]) : 1;
+    if (args->args[1] == nullptr || (args->arg_count == 3 && args->args[2] == nullptr) || count == 0) {
+        *length = args->lengths[0];
+        *is_null = 0;
+        return args->args[0];
+    }
+
+    if (count < 0) {
+        *error = 1;
+        return nullptr;
+    }
+
+    // An invalid sketch is null, as it is for the other functions
+    auto metadata = Metadata::Deserialize(args->args[0], args->lengths[0]);
+    if (!metadata) {
         *is_null = true;
-        return 0.0;
+        return nullptr;
+    }
+
+    if (!data->mapper || (float) data->mapper.value().gamma != metadata.value().gamma) {
+        data->mapper.emplace(metadata.value().gamma);
+    }
+
+    double value = *((double *) args->args[1]);
+    auto key = data->mapper.value().Key(value);
+    Bucket bucket = {.key = key.value_or(0), .count = (unsigned long long) count};
+    if (!key) {
+        *error = 1;
+        return nullptr;
+    }
+    if (!Sketch::AddSerialized(args->args[0], args->lengths[0], bucket, value * count, data->out)) {
+        *is_null = true;
+        return nullptr;
     }
 
-    double q = *((double *) args->args[0]);
+    *length = data->out.size();
+    *is_null = 0;
 
-    return sketch.value().Quantile(q);
+    return data->out.data();
 }
 
-extern "C" [[maybe_unused]] bool dds_merge_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
-    if (args->arg_count != 2 || args->arg_type[0] != STRING_RESULT || args->arg_type[1] != STRING_RESULT) {
-        strcpy(message, "Requires exactly two sketch arguments");
+extern "C" [[maybe_unused]] void dds_add_deinit(UDF_INIT *initid) {
+    delete static_cast<Add_Data *>(static_cast<void *>(initid->ptr));
+}
+
+/*
+ * Adds the values of in, a packed array of little endian doubles, to acc and
+ * their total to sum. Values are copied out of in (which needn't be aligned)
+ * a batch at a time and mapped to keys with KeyMapper#Keys. Returns false if
+ * in isn't a whole number of doubles or a value can't be mapped.
+ */
+static bool add_packed_values(Accumulator &acc, KeyMapper &mapper, const char *in, size_t length, double &sum) {
+    if (length % sizeof(double) != 0) return false;
+
+    double values[KeyMapper::KEYS_BATCH_SIZE];
+    unsigned short keys[KeyMapper::KEYS_BATCH_SIZE];
+    for (size_t offset = 0; offset < length; offset += sizeof(values)) {
+        size_t n = std::min(length - offset, sizeof(values)) / sizeof(double);
+        memcpy(values, in + offset, n * sizeof(double));
+        if (!mapper.Keys(values, n, keys)) return false;
+
+        for (size_t i = 0; i < n; i++) {
+            acc.Add(keys[i], 1);
+            sum += values[i];
+        }
+    }
+
+    return true;
+}
+
+struct Values_Data {
+    std::optional<KeyMapper> mapper; // for the gamma of the last row
+    Accumulator acc;
+    std::string out;
+};
+
+// Keeps the mapper (and its table of bucket bounds) across rows with the same gamma
+static KeyMapper &values_mapper(Values_Data *data, double gamma) {
+    if (!data->mapper || data->mapper.value().gamma != gamma) {
+        data->mapper.emplace(gamma);
+    }
+    return data->mapper.value();
+}
+
+extern "C" [[maybe_unused]] bool dds_from_values_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count < 1 || args->arg_count > 2 || args->arg_type[0] != STRING_RESULT ||
+        (args->arg_count == 2 && args->arg_type[1] != REAL_RESULT && args->arg_type[1] != INT_RESULT &&
+         args->arg_type[1] != DECIMAL_RESULT)) {
+        strcpy(message, "Requires packed values and an optional alpha");
         return true;
     }
 
+    // Tell mysql to cast the alpha to a double
+    if (args->arg_count == 2) args->arg_type[1] = REAL_RESULT;
+
+    initid->maybe_null = true;
     initid->max_length = 65535;
-    initid->ptr = static_cast<char *>(static_cast<void *>(new std::string()));
+    initid->ptr = static_cast<char *>(static_cast<void *>(new Values_Data()));
 
     return false;
 }
 
-extern "C" [[maybe_unused]] char *
-dds_merge(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length, unsigned char *is_null, char *error) {
-    if (!args->args[0] && !args->args[1]) {
+extern "C" [[maybe_unused]] char *dds_from_values(UDF_INIT *initid, UDF_ARGS *args, char *result,
+                                                  unsigned long *length, unsigned char *is_null, char *error) {
+    auto *data = static_cast<Values_Data *>(static_cast<void *>(initid->ptr));
+
+    // No values make no sketch
+    if (args->args[0] == nullptr || args->lengths[0] == 0) {
         *is_null = true;
         return nullptr;
     }
 
-    if (!args->args[0]) {
-        *length = args->lengths[1];
-        return args->args[1];
+    double alpha = DEFAULT_ALPHA;
+    if (args->arg_count == 2) {
+        if (args->args[1] == nullptr || !valid_alpha(*((double *) args->args[1]))) {
+            *error = 1;
+            return nullptr;
+        }
+        alpha = *((double *) args->args[1]);
     }
 
-    if (!args->args[1]) {
-        *length = args->lengths[0];
-        return args->args[0];
+    auto &mapper = values_mapper(data, KeyMapper::Gamma(alpha));
+    double sum = 0;
+    data->acc.Clear();
+    if (!add_packed_values(data->acc, mapper, args->args[0], args->lengths[0], sum)) {
+        *error = 1;
+        return nullptr;
     }
 
-    Accumulator acc;
-    if (!acc.Merge(args->args[0], args->lengths[0])) {
-        *error = true;
+    data->acc.metadata = Metadata{
+            .version = 1,
+            .sum = (float) sum,
+            .count = args->lengths[0] / sizeof(double),
+            .gamma = (float) mapper.gamma,
+    };
+    *is_null = 0;
+
+    return serialize_result(data->acc, result, data->out, length);
+}
+
+extern "C" [[maybe_unused]] void dds_from_values_deinit(UDF_INIT *initid) {
+    delete static_cast<Values_Data *>(static_cast<void *>(initid->ptr));
+}
+
+extern "C" [[maybe_unused]] bool dds_add_values_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 2 || args->arg_type[0] != STRING_RESULT || args->arg_type[1] != STRING_RESULT) {
+        strcpy(message, "Requires a sketch and packed values");
+        return true;
+    }
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new Values_Data()));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *dds_add_values(UDF_INIT *initid, UDF_ARGS *args, char *result,
+                                                 unsigned long *length, unsigned char *is_null, char *error) {
+    auto *data = static_cast<Values_Data *>(static_cast<void *>(initid->ptr));
+
+    if (args->args[0] == nullptr) {
+        *is_null = true;
         return nullptr;
     }
 
-    if (!acc.Merge(args->args[1], args->lengths[1])) {
-        *error = true;
+    data->acc.Clear();
+    if (!data->acc.Merge(args->args[0], args->lengths[0])) {
+        *error = 1;
         return nullptr;
     }
 
-    auto *out = static_cast<std::string *>(static_cast<void *>(initid->ptr));
-    out->assign(acc.ToSketch().Serialize());
-    *length = out->length();
+    // Null values leave the sketch as it is
+    if (args->args[1] != nullptr) {
+        auto &metadata = data->acc.metadata.value();
+        double sum = metadata.sum;
+        if (!add_packed_values(data->acc, values_mapper(data, metadata.gamma), args->args[1], args->lengths[1], sum)) {
+            *error = 1;
+            return nullptr;
+        }
+        metadata.sum = (float) sum;
+        metadata.count += args->lengths[1] / sizeof(double);
+    }
     *is_null = 0;
 
-    return out->data();
+    return serialize_result(data->acc, result, data->out, length);
 }
 
-extern "C" [[maybe_unused]] void dds_merge_deinit(UDF_INIT *initid) {
-    delete static_cast<std::string *>(static_cast<void *>(initid->ptr));
+extern "C" [[maybe_unused]] void dds_add_values_deinit(UDF_INIT *initid) {
+    delete static_cast<Values_Data *>(static_cast<void *>(initid->ptr));
 }
 
-extern "C" [[maybe_unused]] bool dds_mean_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
-    if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
-        strcpy(message, "Requires exactly one sketch argument");
+struct Rank_Data {
+    std::optional<KeyMapper> mapper; // for the gamma of the last sketch
+};
+
+// Key of the bucket a value falls in, for comparing it to a sketch's buckets:
+// -1 for negative values (below every bucket) and USHRT_MAX for values past
+// the largest key. Nothing for NaN.
+static std::optional<int> rank_key(Rank_Data *data, const Metadata &metadata, double value) {
+    if (std::isnan(value)) return {};
+    if (value < 0) return -1;
+
+    if (!data->mapper || (float) data->mapper.value().gamma != metadata.gamma) {
+        data->mapper.emplace(metadata.gamma);
+    }
+    return data->mapper.value().Key(value).value_or(USHRT_MAX);
+}
+
+// Fraction of the sketch's values up to and including key's bucket
+static std::optional<double> rank_fraction(const SketchView &sketch, int key) {
+    if (key < 0) return 0.0;
+
+    auto cuml_count = sketch.CumulativeCount(key);
+    if (!cuml_count) return {};
+
+    return (double) cuml_count.value() / (double) sketch.metadata.count;
+}
+
+// Checks that the arguments other than the sketch (at sketch_arg) are numeric
+// and tells mysql to cast them to doubles
+static bool rank_init(UDF_INIT *initid, UDF_ARGS *args, char *message, unsigned int arg_count,
+                      unsigned int sketch_arg, const char *usage) {
+    if (args->arg_count != arg_count) {
+        strcpy(message, usage);
         return true;
     }
+    for (unsigned int i = 0; i < arg_count; i++) {
+        bool valid = i == sketch_arg ? args->arg_type[i] == STRING_RESULT
+                                     : args->arg_type[i] == REAL_RESULT || args->arg_type[i] == INT_RESULT ||
+                                       args->arg_type[i] == DECIMAL_RESULT;
+        if (!valid) {
+            strcpy(message, usage);
+            return true;
+        }
+        if (i != sketch_arg) args->arg_type[i] = REAL_RESULT;
+    }
 
     initid->maybe_null = true;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new Rank_Data()));
 
     return false;
 }
 
-extern "C" [[maybe_unused]] double dds_mean(UDF_INIT *, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
-    if (args->args[0] == nullptr) {
+static bool null_arg(UDF_ARGS *args) {
+    for (unsigned int i = 0; i < args->arg_count; i++) {
+        if (args->args[i] == nullptr) return true;
+    }
+    return false;
+}
+
+extern "C" [[maybe_unused]] bool dds_rank_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    return rank_init(initid, args, message, 2, 1, "Requires a numeric value and a sketch");
+}
+
+extern "C" [[maybe_unused]] double dds_rank(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
+    auto *data = static_cast<Rank_Data *>(static_cast<void *>(initid->ptr));
+
+    auto sketch = null_arg(args) ? std::nullopt : SketchView::Deserialize(args->args[1], args->lengths[1]);
+    if (!sketch) {
         *is_null = true;
         return 0.0;
     }
 
-    auto metadata = Metadata::Deserialize(args->args[0], args->lengths[0]);
-    if (!metadata) {
+    auto key = rank_key(data, sketch.value().metadata, *((double *) args->args[0]));
+    auto fraction = key ? rank_fraction(sketch.value(), key.value()) : std::nullopt;
+    if (!fraction) {
         *is_null = true;
         return 0.0;
     }
 
-    return metadata.value().Mean();
+    return fraction.value();
 }
 
-extern "C" [[maybe_unused]] bool dds_json_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+extern "C" [[maybe_unused]] void dds_rank_deinit(UDF_INIT *initid) {
+    delete static_cast<Rank_Data *>(static_cast<void *>(initid->ptr));
+}
+
+extern "C" [[maybe_unused]] bool dds_fraction_between_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    return rank_init(initid, args, message, 3, 2, "Requires two numeric bounds and a sketch");
+}
+
+// Both bounds are found in one walk: the count up to lo's bucket is taken on
+// the way to hi's
+extern "C" [[maybe_unused]] double
+dds_fraction_between(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
+    auto *data = static_cast<Rank_Data *>(static_cast<void *>(initid->ptr));
+
+    auto sketch = null_arg(args) ? std::nullopt : SketchView::Deserialize(args->args[2], args->lengths[2]);
+    if (!sketch) {
+        *is_null = true;
+        return 0.0;
+    }
+
+    auto &metadata = sketch.value().metadata;
+    auto lo = rank_key(data, metadata, *((double *) args->args[0]));
+    auto hi = rank_key(data, metadata, *((double *) args->args[1]));
+    if (!lo || !hi) {
+        *is_null = true;
+        return 0.0;
+    }
+    if (hi.value() <= lo.value()) return 0.0;
+
+    unsigned long long below = 0, up_to_hi = 0;
+    Decoder reader = sketch.value().decoder;
+    while (!reader.Empty()) {
+        auto bucket = reader.ReadBucket();
+        if (!bucket) {
+            *is_null = true;
+            return 0.0;
+        }
+        if (bucket.value().key > hi.value()) break;
+
+        if (bucket.value().key <= lo.value()) below += bucket.value().count;
+        up_to_hi += bucket.value().count;
+    }
+
+    return (double) (up_to_hi - below) / (double) metadata.count;
+}
+
+extern "C" [[maybe_unused]] void dds_fraction_between_deinit(UDF_INIT *initid) {
+    delete static_cast<Rank_Data *>(static_cast<void *>(initid->ptr));
+}
+
+extern "C" [[maybe_unused]] bool dds_exceeds_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    return rank_init(initid, args, message, 3, 0, "Requires a sketch, a numeric value and a fraction");
+}
+
+// More than fraction of the values are above value's bucket exactly when
+// fewer than count - fraction * count are in or below it, so the walk stops
+// once that many have been counted
+extern "C" [[maybe_unused]] long long dds_exceeds(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null,
+                                                  unsigned char *) {
+    auto *data = static_cast<Rank_Data *>(static_cast<void *>(initid->ptr));
+
+    auto sketch = null_arg(args) ? std::nullopt : SketchView::Deserialize(args->args[0], args->lengths[0]);
+    if (!sketch) {
+        *is_null = true;
+        return 0;
+    }
+
+    auto &metadata = sketch.value().metadata;
+    auto key = rank_key(data, metadata, *((double *) args->args[1]));
+    double fraction = *((double *) args->args[2]);
+    if (!key || std::isnan(fraction)) {
+        *is_null = true;
+        return 0;
+    }
+    if (key.value() < 0) return fraction < 1;
+
+    auto limit = metadata.ExceedsLimit(fraction);
+    if (limit == 0) return 0;
+    if (limit > metadata.count) return 1;
+
+    auto cuml_count = sketch.value().CumulativeCount(key.value(), limit);
+    if (!cuml_count) {
+        *is_null = true;
+        return 0;
+    }
+
+    return cuml_count.value() < limit;
+}
+
+extern "C" [[maybe_unused]] void dds_exceeds_deinit(UDF_INIT *initid) {
+    delete static_cast<Rank_Data *>(static_cast<void *>(initid->ptr));
+}
+
+extern "C" [[maybe_unused]] bool dds_from_json_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
     if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
-        strcpy(message, "Requires exactly one sketch argument");
+        strcpy(message, "Requires exactly one json argument");
         return true;
     }
 
+    initid->maybe_null = true;
     initid->max_length = 65535;
     initid->ptr = static_cast<char *>(static_cast<void *>(new std::string()));
 
     return false;
 }
 
-extern "C" [[maybe_unused]] char *dds_json(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length,
-                                              unsigned char *is_null, char *error) {
-    if (!args->args[0]) {
+extern "C" [[maybe_unused]] char *dds_from_json(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length,
+                                                unsigned char *is_null, char *) {
+    if (args->args[0] == nullptr) {
+        *is_null = true;
         return nullptr;
     }
 
-    auto sketch = Sketch::Deserialize(args->args[0], args->lengths[0]);
-
+    auto sketch = Sketch::FromJSON(args->args[0], args->lengths[0]);
     if (!sketch) {
-        *error = 1;
+        *is_null = true;
         return nullptr;
     }
 
-    auto *out = static_cast<std::string *>(static_cast<void *>(initid->ptr));
-    out->assign(sketch.value().JSON());
-
-    *length = out->length();
+    auto *buffer = static_cast<std::string *>(static_cast<void *>(initid->ptr));
     *is_null = 0;
 
-    return out->data();
+    return serialize_result(sketch.value(), result, *buffer, length);
 }
 
-extern "C" [[maybe_unused]] void dds_json_deinit(UDF_INIT *initid) {
+extern "C" [[maybe_unused]] void dds_from_json_deinit(UDF_INIT *initid) {
     delete static_cast<std::string *>(static_cast<void *>(initid->ptr));
 }
 
+extern "C" [[maybe_unused]] bool dds_json_compact_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count < 1 || args->arg_type[0] != STRING_RESULT) {
+        strcpy(message, "Requires a sketch and optional quantiles");
+        return true;
+    }
+
+    auto *data = new Quantiles_Data();
+    if (args->arg_count > 1 && quantiles_init(args, message, data->query, data->const_qs)) {
+        delete data;
+        return true;
+    }
+
+    initid->maybe_null = true;
+    initid->max_length = 65535;
+    initid->ptr = static_cast<char *>(static_cast<void *>(data));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *dds_json_compact(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length,
+                                                   unsigned char *is_null, char *) {
+    auto *data = static_cast<Quantiles_Data *>(static_cast<void *>(initid->ptr));
+    bool has_qs = args->arg_count > 1;
+
+    if (args->args[0] == nullptr || (has_qs && !data->const_qs && !quantiles_args(args, data->query))) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    auto sketch = SketchView::Deserialize(args->args[0], args->lengths[0]);
+    if (!sketch || !sketch.value().CompactJSON(data->out, has_qs ? &data->query : nullptr)) {
+        *is_null = true;
+        return nullptr;
+    }
+
+    *length = data->out.length();
+    *is_null = 0;
+
+    return data->out.data();
+}
+
+extern "C" [[maybe_unused]] void dds_json_compact_deinit(UDF_INIT *initid) {
+    delete static_cast<Quantiles_Data *>(static_cast<void *>(initid->ptr));
+}
+
 extern "C" [[maybe_unused]] bool dds_invalid_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
     initid->maybe_null = true;
 
@@ -594,9 +3697,9 @@ extern "C" [[maybe_unused]] long long dds_invalid(UDF_INIT *, UDF_ARGS *args, un
     }
 
     *is_null = 0;
-    auto sketch = Sketch::Deserialize(args->args[0], args->lengths[0]);
+    auto sketch = SketchView::Deserialize(args->args[0], args->lengths[0]);
 
-    return sketch.has_value() ? 0 : 1;
+    return sketch && sketch.value().Valid() ? 0 : 1;
 }
 
 extern "C" [[maybe_unused]] bool dds_count_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
@@ -650,3 +3753,44 @@ extern "C" [[maybe_unused]] double dds_total(UDF_INIT *, UDF_ARGS *args, unsigne
 
     return metadata.value().Sum();
 }
+
+extern "C" [[maybe_unused]] bool dds_stats_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 0) {
+        strcpy(message, "Takes no arguments");
+        return true;
+    }
+
+    initid->max_length = 65535;
+    initid->maybe_null = true;
+    initid->ptr = static_cast<char *>(static_cast<void *>(new std::string()));
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] char *
+dds_stats(UDF_INIT *initid, UDF_ARGS *, char *, unsigned long *length, unsigned char *, char *) {
+    auto *out = static_cast<std::string *>(static_cast<void *>(initid->ptr));
+
+    *out = Stats::JSON();
+    *length = out->size();
+
+    return out->data();
+}
+
+extern "C" [[maybe_unused]] void dds_stats_deinit(UDF_INIT *initid) {
+    delete static_cast<std::string *>(static_cast<void *>(initid->ptr));
+}
+
+extern "C" [[maybe_unused]] bool dds_stats_reset_init(UDF_INIT *, UDF_ARGS *args, char *message) {
+    if (args->arg_count != 0) {
+        strcpy(message, "Takes no arguments");
+        return true;
+    }
+
+    return false;
+}
+
+extern "C" [[maybe_unused]] long long dds_stats_reset(UDF_INIT *, UDF_ARGS *, unsigned char *, unsigned char *) {
+    Stats::Reset();
+    return 0;
+}
@@ -1,8 +1,12 @@
 #ifndef MYSQL_DDS_DDS_H
 #define MYSQL_DDS_DDS_H
 
+#include <array>
+#include <climits>
 #include <optional>
-#include <unordered_map>
+#include <string>
+#include <string_view>
+#include <vector>
 
 struct Metadata {
     unsigned char version = 0;
@@ -22,6 +26,11 @@ struct Metadata {
 
     double Sum() const;
 
+    unsigned long long Rank(double q) const;
+
+    unsigned long long ExceedsLimit(double fraction) const;
+
+    double Value(unsigned short key) const;
 };
 
 struct Bucket {
@@ -37,17 +46,40 @@ struct Bucket {
     }
 };
 
+/*
+ * Reads sketches of any wire format (see the README). Version 1 interleaves
+ * delta encoded keys and counts as varints, read straight from data. Version
+ * 3 is the same but can also encode a run of consecutive keys as a span, one
+ * header followed by just the counts; span_left tracks the rest of the span
+ * being read. Version 2 stores the number of buckets followed by separate key
+ * and count blocks, each with its own control bytes; ReadMetadata checks the
+ * block lengths up front and sets up the block pointers. After ReadMetadata,
+ * ReadBucket and Empty work the same for every version.
+ */
 struct Decoder {
     const char *data;
     const char *end;
     unsigned long long prev_key = 0;
 
+    unsigned char version = 1;
+    unsigned long long span_left = 0; // version 3
+
+    // Version 2 bucket blocks, set up by ReadMetadata
+    uint64_t bucket_count = 0;
+    uint64_t bucket_index = 0;
+    const unsigned char *key_control = nullptr;
+    const unsigned char *count_control = nullptr;
+    const char *keys = nullptr;
+    const char *counts = nullptr;
+
     Decoder(const char *data, size_t len);
 
     bool Empty() const;
 
     std::optional<uint64_t> ReadVarint(int max_len);
 
+    std::optional<uint64_t> ReadVarintChecked(int max_len);
+
     std::optional<uint16_t> ReadVarint16();
 
     std::optional<uint64_t> ReadVarint64();
@@ -58,11 +90,124 @@ struct Decoder {
 
     std::optional<Metadata> ReadMetadata();
 
+    bool ReadBucketBlocks();
+
     std::optional<Bucket> ReadBucket();
 
+    std::optional<Bucket> ReadBucketV2();
+
+    std::optional<Bucket> ReadBucketV3();
+
+    bool ReadSpanCounts(unsigned long long *out);
+
     std::optional<const char *> Advance(size_t len);
 
     size_t BytesLeft() const;
+
+    size_t MaxBucketsLeft() const;
+};
+
+/*
+ * Maps raw values to bucket keys, the same as ceil(log(value) / log(gamma))
+ * but without a log() call per value. A cubic approximation of log2 built
+ * from the float's exponent and mantissa gives a key that is at most one off,
+ * which is then corrected against a table of bucket bounds (gamma ^ key). The
+ * table grows lazily up to the largest key seen, so bounds are only computed
+ * once per key rather than once per value.
+ *
+ * Values <= 1 map to key 0. Negative, NaN and infinite values, and values
+ * whose key doesn't fit in a 16 bit key, can't be mapped.
+ */
+struct KeyMapper {
+    double gamma;
+    double inv_log2_gamma;
+    std::vector<double> bounds; // bounds[k] = gamma ^ k, upper bound of bucket k
+
+    explicit KeyMapper(double gamma);
+
+    static double Gamma(double alpha);
+
+    static const size_t KEYS_BATCH_SIZE = 256;
+
+    std::optional<unsigned short> Key(double value);
+
+    bool Keys(const double *values, size_t n, unsigned short *keys);
+
+    std::optional<unsigned short> RefineKey(double value, double estimate);
+
+    void GrowBounds(size_t key);
+};
+
+/*
+ * Cache of bucket values (Metadata#Value) for up to GAMMAS gammas, so that
+ * repeated lookups are a table read instead of a pow() call. Each table is
+ * filled lazily up to the largest key requested. Tables are never evicted, so
+ * rows that alternate between gammas don't refill them; values of further
+ * gammas are computed directly.
+ */
+struct ValueTable {
+    static const size_t GAMMAS = 4;
+
+    std::array<float, GAMMAS> gammas{}; // 0 for an unused table
+    std::array<std::vector<double>, GAMMAS> values;
+
+    double Value(const Metadata &metadata, unsigned short key);
+};
+
+/*
+ * Maps bucket keys of one gamma onto the keys of a coarser gamma (to >= from),
+ * so sketches of different accuracy can be merged. Bucket k covers
+ * (from ^ (k - 1), from ^ k], which is (k - 1) * ratio to k * ratio in units of
+ * target keys, so it overlaps at most two target buckets.
+ *
+ * When to is an integer power of from the bucket bounds line up and each
+ * bucket maps to exactly one target bucket. Otherwise a bucket's count is
+ * split between the two target buckets it overlaps in proportion to the
+ * overlap (in log space). A split moves values by at most one target bucket,
+ * so quantiles of the result are within about from's alpha plus to's alpha.
+ */
+struct GammaRemapper {
+    double ratio; // log(from) / log(to), at most 1
+    unsigned int power = 0; // to = from ^ power, or 0 if the bounds don't line up
+
+    GammaRemapper(float from, float to);
+
+    // Target buckets for bucket, the lower one first. Either count may be 0.
+    std::array<Bucket, 2> Remap(const Bucket &bucket) const;
+};
+
+/*
+ * A set of quantiles answered with a single cumulative walk over buckets in
+ * key order. #Set (or filling qs and calling #Sort) orders the requested
+ * quantiles once, #Start resets the walk for a sketch, then buckets are fed
+ * to #Add until it returns true (every quantile has been reached) or the
+ * buckets run out, followed by #Finish.
+ *
+ * Values are reported in the order the quantiles were requested. Vectors are
+ * reused between calls so answering quantiles row after row doesn't allocate.
+ */
+struct QuantileQuery {
+    std::vector<double> qs;
+    std::vector<size_t> order; // indexes into qs, by increasing quantile
+    std::vector<unsigned long long> ranks; // rank of each quantile, in order
+    std::vector<double> values;
+
+    Metadata metadata;
+    unsigned long long cuml_count = 0;
+    size_t next = 0; // index into order of the next quantile to reach
+    std::optional<unsigned short> last_key;
+
+    void Set(const double *in, size_t n);
+
+    void Sort();
+
+    void Start(const Metadata &metadata);
+
+    bool Add(const Bucket &bucket);
+
+    bool Finish();
+
+    std::string JSON() const;
 };
 
 /*
@@ -70,42 +215,287 @@ struct Decoder {
  * when deserializing.
  *
  * The buckets field must be provided in order of Bucket#key.
+ *
+ * Quantile and rank queries scan the buckets up to the answer, unless
+ * #BuildIndex has filled cuml_counts, the cumulative count up to and including
+ * each bucket, which they then binary search. A sketch that is queried many
+ * times (such as a constant argument) is indexed once up front; queries never
+ * write to the sketch, so it can be shared between threads.
  */
 struct Sketch {
     const Metadata metadata;
     const std::vector<Bucket> buckets;
+    std::vector<unsigned long long> cuml_counts = {};
 
     static std::vector<uint8_t> EncodeVarint(uint64_t val);
 
+    static size_t VarintSize(uint64_t val);
+
+    static char *WriteVarint(char *out, uint64_t val);
+
+    static size_t MetadataSize(const Metadata &metadata);
+
+    static char *WriteMetadata(char *out, const Metadata &metadata);
+
     static std::optional<Sketch> Deserialize(const char *in, size_t length);
 
+    static std::optional<Sketch> FromJSON(const char *in, size_t length);
+
+    static bool AddSerialized(const char *in, size_t length, const Bucket &bucket, double sum, std::string &out);
+
     double Quantile(double q) const;
 
+    unsigned short QuantileKey(double q) const;
+
+    void Quantiles(QuantileQuery &query) const;
+
+    unsigned long long CumulativeCount(unsigned short key) const;
+
+    void BuildIndex();
+
+    bool Indexed() const;
+
     std::string Inspect() const;
 
     std::string Serialize() const;
 
+    size_t SerializedSize() const;
+
+    char *SerializeTo(char *out) const;
+
     std::string JSON();
 };
 
 /*
- * Mutable container that can have multiple sketches Merged in. Stores bucket
- * as an unordered map which is efficient when many sketches are merged in
- * because merging pre-existing buckets is just a map lookup and an integer
- * increment.
+ * Non-owning, read-only view of a serialized sketch. Only the metadata is
+ * decoded up front; buckets are decoded lazily from the underlying buffer, so
+ * reading a sketch through a view never allocates. The buffer must outlive the
+ * view.
  *
- * Can be converted to a Sketch object via #ToSketch. This requires sorting the
- * map keys to construct an ordered Bucket vector.
+ * Deserialize only validates the metadata. Iterating stops at the first bucket
+ * that fails to decode, so use #Valid (or #BucketCount) first where the whole
+ * sketch needs to be checked.
+ */
+struct SketchView {
+    Metadata metadata;
+    Decoder decoder; // positioned at the first bucket
+
+    struct Iterator {
+        Decoder decoder;
+        std::optional<Bucket> bucket;
+
+        const Bucket &operator*() const {
+            return *bucket;
+        }
+
+        Iterator &operator++() {
+            bucket = decoder.Empty() ? std::nullopt : decoder.ReadBucket();
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) const {
+            return bucket.has_value() != other.bucket.has_value();
+        }
+    };
+
+    static std::optional<SketchView> Deserialize(const char *in, size_t length);
+
+    Iterator begin() const;
+
+    Iterator end() const;
+
+    std::optional<size_t> BucketCount() const;
+
+    bool Valid() const;
+
+    std::optional<double> Quantile(double q) const;
+
+    std::optional<unsigned short> QuantileKey(double q) const;
+
+    std::optional<unsigned long long> CumulativeCount(unsigned short key, unsigned long long limit = ULLONG_MAX) const;
+
+    bool Quantiles(QuantileQuery &query) const;
+
+    std::string Inspect() const;
+
+    void Inspect(std::string &out) const;
+
+    std::string JSON() const;
+
+    void JSON(std::string &out) const;
+
+    bool CompactJSON(std::string &out, QuantileQuery *query) const;
+};
+
+/*
+ * Loops over arrays of bucket counts, in a scalar version and, on x86-64,
+ * SSE4.2, AVX2 and AVX-512 versions. All versions give identical results.
+ *
+ * #All lists the versions the CPU supports, scalar first and widest last.
+ * #Best is the widest, picked once when the library is loaded, so one build
+ * runs on any x86-64 CPU.
+ */
+struct Kernels {
+    const char *name;
+
+    // out[i] += in[i] for i < n
+    void (*add_counts)(unsigned long long *out, const unsigned long long *in, size_t n);
+
+    // out[i] is the sum of the counts of buckets[0..i]
+    void (*cumulative_counts)(const Bucket *buckets, size_t n, unsigned long long *out);
+
+    // Index of the first count where cumulative plus the counts up to and
+    // including it reaches rank, or n. cumulative is advanced past the counts
+    // up to and including that index.
+    size_t (*find_rank)(const unsigned long long *counts, size_t n, unsigned long long &cumulative,
+                        unsigned long long rank);
+
+    static const std::vector<Kernels> &All();
+
+    static const Kernels &Best();
+};
+
+/*
+ * Mutable container that can have multiple sketches Merged in. Bucket counts
+ * are stored in a dense array indexed by key, covering a window of keys that
+ * grows on demand. Merging a bucket is an indexed add, with no hashing or
+ * allocation once the window covers the incoming keys.
+ *
+ * The range of keys that have been touched is tracked in min_key/max_key so
+ * that #ToSketch only walks that range (already in key order, so no sort is
+ * needed) and #Clear only zeroes it, keeping the allocation for reuse.
  */
 struct Accumulator {
     std::optional<Metadata> metadata;
-    std::unordered_map<unsigned short, unsigned long long> buckets;
+
+    // counts[i] is the count for key (base + i)
+    std::vector<unsigned long long> counts;
+    unsigned short base = 0;
+
+    // Touched key range, empty when min_key > max_key
+    unsigned short min_key = USHRT_MAX;
+    unsigned short max_key = 0;
 
     bool Merge(const char *in, size_t length);
 
+    bool Merge(const Sketch &sketch);
+
+    bool Merge(const char *in, size_t length, float gamma);
+
+    bool Merge(const Accumulator &other);
+
+    bool MergeMany(const std::vector<std::string_view> &sketches, unsigned int threads);
+
+    bool MergeMetadata(const Metadata &in);
+
+    void Add(unsigned short key, unsigned long long count);
+
+    bool Empty() const;
+
+    // Iterates the non-empty buckets of the window in key order, or just the
+    // first bucket if all are empty
+    struct Iterator {
+        const Accumulator *acc;
+        size_t key;
+
+        Bucket operator*() const {
+            return {.key = (unsigned short) key, .count = acc->counts[key - acc->base]};
+        }
+
+        Iterator &operator++() {
+            do {
+                key++;
+            } while (key <= acc->max_key && acc->counts[key - acc->base] == 0);
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) const {
+            return key != other.key;
+        }
+    };
+
+    Iterator begin() const;
+
+    Iterator end() const;
+
+    std::vector<Bucket> Buckets() const;
+
     Sketch ToSketch() const;
 
+    size_t SerializedSize() const;
+
+    char *SerializeTo(char *out) const;
+
+    void Quantiles(QuantileQuery &query) const;
+
+    void Grow(unsigned short key);
+
+    void Collapse(size_t max_buckets);
+
     void Clear();
 };
 
+/*
+ * Merges version 1 sketches straight from their encodings into a version 1
+ * sketch, as a k-way merge of their buckets (which are in key order): each
+ * step takes the lowest key among the inputs' next buckets and sums the
+ * counts at that key. Output varints are written directly to out, so there
+ * is no accumulator, bucket vector or sort, and the decoders are reused from
+ * call to call. With the few inputs of a UDF call the lowest key is found by
+ * a linear scan.
+ *
+ * The first sketch must be version 1, and Merge returns false otherwise:
+ * the output is always written as version 1, so callers such as dds_merge
+ * only take this path when the first sketch is version 1 and merge the others
+ * through an Accumulator. The later sketches may be of any version. The
+ * result is the same as merging the sketches into an Accumulator and
+ * serializing it.
+ */
+struct StreamingMerge {
+    std::vector<Decoder> decoders;
+    std::vector<std::optional<Bucket>> heads; // next bucket of each input
+
+    bool Merge(const std::vector<std::string_view> &sketches, std::string &out);
+};
+
+/*
+ * Process wide counters of the work done by the library, reported by the
+ * dds_stats() UDF. Threads count into a fixed set of shards, each on its own
+ * cache line, so a count is a relaxed atomic add with no lock and, until
+ * there are more threads than shards, no shared cache line. Totals sums the
+ * shards under a lock. Reset doesn't write to the shards, it records the
+ * current totals as a baseline.
+ *
+ * Times are estimated by timing one in TIME_SAMPLE_PERIOD calls, to keep
+ * clock reads off most calls.
+ */
+struct Stats {
+    enum Counter {
+        SKETCHES_DECODED,
+        BYTES_DECODED,
+        BUCKETS_MERGED,
+        DECODE_FAILURES,
+        OUTPUT_BYTES,
+        MERGE_NS,
+        SERIALIZE_NS,
+        COUNTERS
+    };
+
+    static const unsigned int TIME_SAMPLE_PERIOD = 16;
+
+    static void Add(Counter counter, unsigned long long n);
+
+    static void Peak(unsigned long long accumulator_bytes);
+
+    static bool SampleTime();
+
+    static std::array<unsigned long long, COUNTERS> Totals();
+
+    static unsigned long long PeakAccumulatorBytes();
+
+    static void Reset();
+
+    static std::string JSON();
+};
+
 #endif //MYSQL_DDS_DDS_H
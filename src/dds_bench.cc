@@ -0,0 +1,482 @@
+/*
+ * Micro-benchmarks for the codec and merge hot paths, run with
+ *
+ *     tmp/build/dds_bench --benchmark_out=bench.json --benchmark_out_format=json
+ *
+ * Besides time per op, each benchmark reports bytes/s of serialized sketch
+ * processed (where that makes sense) and heap allocations per op, counted by
+ * the replacement operator new below.
+ *
+ * Sketches come from two generators: synthetic sketches with a given number
+ * of buckets, maximum gap between keys (spread) and maximum count (magnitude),
+ * and sketches of values drawn from lognormal or bimodal distributions, which
+ * look like latency sketches.
+ */
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <random>
+
+#include "dds.h"
+
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+// Reports allocations per op since start
+static void CountAllocations(benchmark::State &state, size_t start) {
+    state.counters["allocs/op"] = benchmark::Counter((double) (allocations.load() - start),
+                                                     benchmark::Counter::kAvgIterations);
+}
+
+static Sketch Synthetic(size_t bucket_count, unsigned int spread, unsigned long long magnitude,
+                        unsigned char version = 1) {
+    std::mt19937_64 rng(bucket_count * 31 + spread);
+    std::vector<Bucket> buckets;
+    unsigned long long count = 0;
+    size_t key = 100;
+    for (size_t i = 0; i < bucket_count && key <= USHRT_MAX; i++) {
+        buckets.push_back({.key = (unsigned short) key, .count = 1 + rng() % magnitude});
+        count += buckets.back().count;
+        key += 1 + rng() % spread;
+    }
+
+    return Sketch{
+            .metadata = {.version = version, .sum = (float) count * 50, .count = count, .gamma = 1.0202},
+            .buckets = buckets,
+    };
+}
+
+enum Distribution {
+    LOGNORMAL, BIMODAL
+};
+
+// Sketch of value_count values with alpha 0.01. Lognormal values are centered
+// around 20 (e.g. ms), bimodal ones are a mix of a fast mode around 2 and a
+// slow mode around 500.
+static Sketch Values(Distribution distribution, size_t value_count, unsigned char version = 1) {
+    std::mt19937_64 rng(value_count);
+    std::lognormal_distribution<double> fast(log(2), 0.5), typical(log(20), 1.0), slow(log(500), 0.3);
+    KeyMapper mapper(KeyMapper::Gamma(0.01));
+
+    std::map<unsigned short, unsigned long long> counts;
+    double sum = 0;
+    for (size_t i = 0; i < value_count; i++) {
+        double value = distribution == LOGNORMAL ? typical(rng) : rng() % 10 < 8 ? fast(rng) : slow(rng);
+        counts[mapper.Key(value).value()]++;
+        sum += value;
+    }
+
+    std::vector<Bucket> buckets;
+    for (auto [key, count]: counts) {
+        buckets.push_back({.key = key, .count = count});
+    }
+    return Sketch{
+            .metadata = {.version = version, .sum = (float) sum, .count = value_count, .gamma = (float) mapper.gamma},
+            .buckets = buckets,
+    };
+}
+
+// Synthetic sketch for benchmarks taking {buckets, spread, magnitude, version}
+static Sketch SyntheticArg(const benchmark::State &state) {
+    return Synthetic(state.range(0), state.range(1), state.range(2), state.range(3));
+}
+
+static void SyntheticArgs(benchmark::internal::Benchmark *b, std::initializer_list<long> versions) {
+    b->ArgNames({"buckets", "spread", "magnitude", "version"});
+    for (long version: versions) {
+        b->Args({20, 4, 100, version});
+        b->Args({500, 2, 1000, version});
+        b->Args({2000, 1, 1000000, version});
+        b->Args({2000, 20, 10, version});
+    }
+}
+
+static void SyntheticArgs(benchmark::internal::Benchmark *b) {
+    SyntheticArgs(b, {1, 2, 3});
+}
+
+// For code that only handles version 1 sketches
+static void SyntheticV1Args(benchmark::internal::Benchmark *b) {
+    SyntheticArgs(b, {1});
+}
+
+static void DistributionArgs(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"distribution", "values"});
+    for (long distribution: {LOGNORMAL, BIMODAL}) {
+        for (long values: {100, 100000}) {
+            b->Args({distribution, values});
+        }
+    }
+}
+
+static void BM_ReadVarint(benchmark::State &state) {
+    // Varints of up to magnitude, e.g. 100 for 1 byte and 1 << 40 for 6 bytes
+    std::mt19937_64 rng(1);
+    std::string bytes;
+    for (int i = 0; i < 4096; i++) {
+        auto encoded = Sketch::EncodeVarint(rng() % state.range(0));
+        bytes.append(encoded.begin(), encoded.end());
+    }
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        Decoder decoder(bytes.data(), bytes.size());
+        uint64_t total = 0;
+        while (!decoder.Empty()) {
+            total += decoder.ReadVarint64().value();
+        }
+        benchmark::DoNotOptimize(total);
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+    state.SetItemsProcessed(state.iterations() * 4096);
+}
+BENCHMARK(BM_ReadVarint)->ArgName("magnitude")->Arg(100)->Arg(1 << 20)->Arg(1LL << 40);
+
+static void BM_Deserialize(benchmark::State &state) {
+    auto bytes = SyntheticArg(state).Serialize();
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(Sketch::Deserialize(bytes.data(), bytes.size()));
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_Deserialize)->Apply(SyntheticArgs);
+
+static void BM_DeserializeDistribution(benchmark::State &state) {
+    auto bytes = Values((Distribution) state.range(0), state.range(1)).Serialize();
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(Sketch::Deserialize(bytes.data(), bytes.size()));
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_DeserializeDistribution)->Apply(DistributionArgs);
+
+static void BM_AccumulatorMerge(benchmark::State &state) {
+    auto bytes = SyntheticArg(state).Serialize();
+    Accumulator acc;
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(acc.Merge(bytes.data(), bytes.size()));
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_AccumulatorMerge)->Apply(SyntheticArgs);
+
+static void BM_AccumulatorMergeDistribution(benchmark::State &state) {
+    auto bytes = Values((Distribution) state.range(0), state.range(1)).Serialize();
+    Accumulator acc;
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(acc.Merge(bytes.data(), bytes.size()));
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_AccumulatorMergeDistribution)->Apply(DistributionArgs);
+
+// Merging a new sketch into a stored one through the accumulator, as dds_merge
+// does when resizing, and streamed, as it does for version 1 sketches
+static void BM_MergeTwo(benchmark::State &state) {
+    auto stored = SyntheticArg(state).Serialize();
+    auto incoming = Synthetic(100, 3, 100).Serialize();
+    Accumulator acc;
+    std::string out;
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        acc.Clear();
+        acc.Merge(stored.data(), stored.size());
+        acc.Merge(incoming.data(), incoming.size());
+        out.resize(acc.SerializedSize());
+        benchmark::DoNotOptimize(acc.SerializeTo(out.data()));
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * (stored.size() + incoming.size()));
+}
+BENCHMARK(BM_MergeTwo)->Apply(SyntheticV1Args);
+
+static void BM_StreamingMergeTwo(benchmark::State &state) {
+    auto stored = SyntheticArg(state).Serialize();
+    auto incoming = Synthetic(100, 3, 100).Serialize();
+    std::vector<std::string_view> sketches = {stored, incoming};
+    StreamingMerge merger;
+    std::string out;
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        if (!merger.Merge(sketches, out)) {
+            state.SkipWithError("merge failed");
+            break;
+        }
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * (stored.size() + incoming.size()));
+}
+BENCHMARK(BM_StreamingMergeTwo)->Apply(SyntheticV1Args);
+
+static void BM_ToSketch(benchmark::State &state) {
+    Accumulator acc;
+    acc.Merge(SyntheticArg(state));
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(acc.ToSketch());
+    }
+
+    CountAllocations(state, start);
+}
+BENCHMARK(BM_ToSketch)->Apply(SyntheticArgs);
+
+static void BM_Serialize(benchmark::State &state) {
+    auto sketch = SyntheticArg(state);
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(sketch.Serialize());
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * sketch.SerializedSize());
+}
+BENCHMARK(BM_Serialize)->Apply(SyntheticArgs);
+
+static void BM_AccumulatorSerializeTo(benchmark::State &state) {
+    Accumulator acc;
+    acc.Merge(SyntheticArg(state));
+    std::string out(acc.SerializedSize(), '\0');
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(acc.SerializeTo(out.data()));
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * out.size());
+}
+BENCHMARK(BM_AccumulatorSerializeTo)->Apply(SyntheticArgs);
+
+static void BM_Quantile(benchmark::State &state) {
+    // A fresh sketch each time, as a one-off query would have
+    auto original = Values((Distribution) state.range(0), state.range(1));
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        Sketch sketch = {.metadata = original.metadata, .buckets = original.buckets};
+        benchmark::DoNotOptimize(sketch.Quantile(0.99));
+    }
+
+    CountAllocations(state, start);
+}
+BENCHMARK(BM_Quantile)->Apply(DistributionArgs);
+
+// Queries of one indexed sketch, as for a constant dds_quantile argument
+static void BM_QuantileRepeated(benchmark::State &state) {
+    auto sketch = Values((Distribution) state.range(0), state.range(1));
+    sketch.BuildIndex();
+    double q = 0;
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(sketch.Quantile(q));
+        q = q >= 1 ? 0 : q + 0.001;
+    }
+
+    CountAllocations(state, start);
+}
+BENCHMARK(BM_QuantileRepeated)->Apply(DistributionArgs);
+
+// The quantiles of dds_sum_quantiles, answered from the accumulated window
+static void BM_AccumulatorQuantiles(benchmark::State &state) {
+    Accumulator acc;
+    acc.Merge(SyntheticArg(state));
+    std::vector<double> qs = {0.5, 0.9, 0.99};
+    QuantileQuery query;
+    query.Set(qs.data(), qs.size());
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        acc.Quantiles(query);
+        benchmark::DoNotOptimize(query.values.data());
+    }
+
+    CountAllocations(state, start);
+}
+BENCHMARK(BM_AccumulatorQuantiles)->Apply(SyntheticArgs);
+
+static void BM_SketchViewQuantile(benchmark::State &state) {
+    auto bytes = Values((Distribution) state.range(0), state.range(1)).Serialize();
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        auto view = SketchView::Deserialize(bytes.data(), bytes.size());
+        benchmark::DoNotOptimize(view.value().Quantile(0.99));
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_SketchViewQuantile)->Apply(DistributionArgs);
+
+static void BM_SketchViewJSON(benchmark::State &state) {
+    auto bytes = Values((Distribution) state.range(0), state.range(1)).Serialize();
+    std::string out;
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        SketchView::Deserialize(bytes.data(), bytes.size()).value().JSON(out);
+        benchmark::DoNotOptimize(out.data());
+    }
+
+    CountAllocations(state, start);
+    state.SetBytesProcessed(state.iterations() * out.size());
+}
+BENCHMARK(BM_SketchViewJSON)->Apply(DistributionArgs);
+
+static void BM_KeyMapper(benchmark::State &state) {
+    std::mt19937_64 rng(1);
+    std::lognormal_distribution<double> values(log(20), 1.0);
+    std::vector<double> input(4096);
+    for (auto &value: input) {
+        value = values(rng);
+    }
+    KeyMapper mapper(KeyMapper::Gamma(0.01));
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        for (auto value: input) {
+            benchmark::DoNotOptimize(mapper.Key(value));
+        }
+    }
+
+    CountAllocations(state, start);
+    state.SetItemsProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_KeyMapper);
+
+static void BM_KeyMapperKeys(benchmark::State &state) {
+    std::mt19937_64 rng(1);
+    std::lognormal_distribution<double> values(log(20), 1.0);
+    std::vector<double> input(4096);
+    for (auto &value: input) {
+        value = values(rng);
+    }
+    std::vector<unsigned short> keys(input.size());
+    KeyMapper mapper(KeyMapper::Gamma(0.01));
+
+    auto start = allocations.load();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(mapper.Keys(input.data(), input.size(), keys.data()));
+    }
+
+    CountAllocations(state, start);
+    state.SetItemsProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_KeyMapperKeys);
+
+// Each kernel version the CPU supports (see Kernels::All), over a dense
+// window of counts of the given size
+static void KernelArgs(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"kernels", "counts"});
+    for (long variant = 0; variant < (long) Kernels::All().size(); variant++) {
+        for (long count: {64, 1024, 16384}) {
+            b->Args({variant, count});
+        }
+    }
+}
+
+static std::vector<unsigned long long> Counts(size_t count) {
+    std::mt19937_64 rng(count);
+    std::vector<unsigned long long> counts(count);
+    for (auto &c: counts) {
+        c = rng() % 4 == 0 ? 0 : rng() % 1000;
+    }
+    return counts;
+}
+
+static void BM_AddCounts(benchmark::State &state) {
+    auto &kernels = Kernels::All()[state.range(0)];
+    auto in = Counts(state.range(1));
+    std::vector<unsigned long long> out(in.size());
+
+    for (auto _: state) {
+        kernels.add_counts(out.data(), in.data(), in.size());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(kernels.name);
+    state.SetItemsProcessed(state.iterations() * in.size());
+}
+BENCHMARK(BM_AddCounts)->Apply(KernelArgs);
+
+static void BM_CumulativeCounts(benchmark::State &state) {
+    auto &kernels = Kernels::All()[state.range(0)];
+    auto counts = Counts(state.range(1));
+    std::vector<Bucket> buckets(counts.size());
+    for (size_t i = 0; i < counts.size(); i++) {
+        buckets[i] = {.key = (unsigned short) i, .count = counts[i]};
+    }
+    std::vector<unsigned long long> out(counts.size());
+
+    for (auto _: state) {
+        kernels.cumulative_counts(buckets.data(), buckets.size(), out.data());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(kernels.name);
+    state.SetItemsProcessed(state.iterations() * buckets.size());
+}
+BENCHMARK(BM_CumulativeCounts)->Apply(KernelArgs);
+
+// Finding the median, which scans half of the window
+static void BM_FindRank(benchmark::State &state) {
+    auto &kernels = Kernels::All()[state.range(0)];
+    auto counts = Counts(state.range(1));
+    unsigned long long total = 0;
+    for (auto count: counts) {
+        total += count;
+    }
+
+    for (auto _: state) {
+        unsigned long long cumulative = 0;
+        benchmark::DoNotOptimize(kernels.find_rank(counts.data(), counts.size(), cumulative, total / 2));
+    }
+
+    state.SetLabel(kernels.name);
+    state.SetItemsProcessed(state.iterations() * counts.size() / 2);
+}
+BENCHMARK(BM_FindRank)->Apply(KernelArgs);
+
+BENCHMARK_MAIN();
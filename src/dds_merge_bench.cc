@@ -0,0 +1,72 @@
+/*
+ * Scaling benchmark for Accumulator#MergeMany. Merges the same set of random
+ * sketches with 1 thread up to one per core and reports the throughput and
+ * speedup over a single thread.
+ *
+ *     dds_merge_bench [sketch count] [buckets per sketch]
+ */
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+
+#include "dds.h"
+
+int main(int argc, char **argv) {
+    size_t sketch_count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    size_t bucket_count = argc > 2 ? strtoul(argv[2], nullptr, 10) : 50;
+
+    // Sketches of latency like values, each with buckets spread over a few
+    // hundred keys around a random center
+    std::mt19937_64 rng(1);
+    std::vector<std::string> serialized;
+    serialized.reserve(sketch_count);
+    for (size_t i = 0; i < sketch_count; i++) {
+        std::vector<Bucket> buckets;
+        unsigned long long count = 0;
+        size_t key = 200 + rng() % 600;
+        for (size_t b = 0; b < bucket_count; b++) {
+            key += 1 + rng() % 8;
+            // Stop at the largest key rather than wrap around
+            if (key > USHRT_MAX) break;
+            buckets.push_back({.key = (unsigned short) key, .count = 1 + rng() % 100});
+            count += buckets.back().count;
+        }
+        Sketch sketch = {
+                .metadata = {.version = 1, .sum = (float) count * 100, .count = count, .gamma = 1.0202},
+                .buckets = buckets,
+        };
+        serialized.push_back(sketch.Serialize());
+    }
+    std::vector<std::string_view> sketches(serialized.begin(), serialized.end());
+
+    unsigned int cores = std::max(1U, std::thread::hardware_concurrency());
+    printf("%zu sketches of %zu buckets, %u cores\n", sketch_count, bucket_count, cores);
+    printf("%8s %12s %16s %8s\n", "threads", "seconds", "sketches/s", "speedup");
+
+    // Powers of two up to the number of cores, and then all of them
+    std::vector<unsigned int> thread_counts;
+    for (unsigned int threads = 1; threads < cores; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(cores);
+
+    double single = 0;
+    for (auto threads: thread_counts) {
+        Accumulator acc;
+        auto start = std::chrono::steady_clock::now();
+        if (!acc.MergeMany(sketches, threads)) {
+            fprintf(stderr, "merge failed\n");
+            return 1;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (threads == 1) single = elapsed.count();
+        printf("%8u %12.3f %16.0f %7.2fx\n", threads, elapsed.count(), sketch_count / elapsed.count(),
+               single / elapsed.count());
+    }
+
+    return 0;
+}
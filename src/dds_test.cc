@@ -1,9 +1,14 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <cfloat>
 #include <climits>
 #include <cmath>
 #include <array>
 #include <unordered_map>
 #include <map>
+#include <random>
+#include <sstream>
+#include <thread>
 #include "dds.h"
 
 TEST(Metadata, ValidChecksGamma) {
@@ -31,6 +36,10 @@ TEST(Metadata, ValidChecksVersion) {
     metadata.version = 1;
     EXPECT_TRUE(metadata.Valid());
     metadata.version = 2;
+    EXPECT_TRUE(metadata.Valid());
+    metadata.version = 3;
+    EXPECT_TRUE(metadata.Valid());
+    metadata.version = 4;
     EXPECT_FALSE(metadata.Valid());
 }
 
@@ -47,7 +56,7 @@ TEST(Metadata, ValidChecksCount) {
 TEST(Metadata, Mergeable) {
     EXPECT_TRUE((Metadata{.version = 1, .gamma = 1.1}).Mergeable(Metadata{.version = 1, .gamma = 1.1}));
     EXPECT_FALSE((Metadata{.version = 1, .gamma = 1.1}).Mergeable(Metadata{.version = 1, .gamma = 1.2}));
-    EXPECT_FALSE((Metadata{.version = 1, .gamma = 1.1}).Mergeable(Metadata{.version = 2, .gamma = 1.1}));
+    EXPECT_TRUE((Metadata{.version = 1, .gamma = 1.1}).Mergeable(Metadata{.version = 2, .gamma = 1.1}));
 }
 
 TEST(Metadata, Mean) {
@@ -59,6 +68,29 @@ TEST(Metadata, Mean) {
     EXPECT_FLOAT_EQ(metadata.Mean(), 20.0);
 }
 
+TEST(Metadata, ExceedsLimit) {
+    // Values up to the bucket exceed fraction exactly when 1 - rank > fraction
+    for (unsigned long long count = 1; count < 200; count++) {
+        Metadata metadata = {.version = 1, .sum = 1, .count = count, .gamma = 1.02};
+        for (int percent = -10; percent <= 110; percent++) {
+            double fraction = percent / 100.0;
+            auto limit = metadata.ExceedsLimit(fraction);
+            for (unsigned long long cuml_count = 0; cuml_count <= count; cuml_count++) {
+                bool exceeds = 1 - (double) cuml_count / (double) count > fraction;
+                ASSERT_EQ(cuml_count < limit, exceeds)
+                                            << "count = " << count << ", fraction = " << fraction
+                                            << ", cuml_count = " << cuml_count;
+            }
+        }
+    }
+
+    // 1 of 20 values at or below: 1 - 0.05 is not above 0.95
+    EXPECT_EQ((Metadata{.count = 20}).ExceedsLimit(0.95), 1);
+    EXPECT_EQ((Metadata{.count = 10}).ExceedsLimit(0.7), 3);
+    EXPECT_EQ((Metadata{.count = 10}).ExceedsLimit(1), 0);
+    EXPECT_EQ((Metadata{.count = 10}).ExceedsLimit(-0.5), 11);
+}
+
 TEST(Bucket, LessThan) {
     EXPECT_TRUE(Bucket{.key = 1} < Bucket{.key = 2});
     EXPECT_FALSE(Bucket{.key = 2} < Bucket{.key = 2});
@@ -117,6 +149,42 @@ TEST(Decoder, MultipleVarints) {
     EXPECT_EQ(dec.ReadVarint(10), std::nullopt);
 }
 
+TEST(Decoder, VarintMatchesChecked) {
+    // Buffers mixing short varints, long varints and unterminated runs, read
+    // from every offset so both the word-at-a-time and the byte-by-byte paths
+    // are hit, including near the end of the buffer.
+    std::mt19937_64 rng(42);
+    for (int round = 0; round < 2000; round++) {
+        std::vector<unsigned char> bytes(rng() % 24);
+        for (auto &byte: bytes) {
+            switch (rng() % 4) {
+                case 0:
+                    byte = rng() & 0x7f;
+                    break;
+                case 1:
+                    byte = 0xff;
+                    break;
+                default:
+                    byte = rng();
+            }
+        }
+
+        for (size_t offset = 0; offset <= bytes.size(); offset++) {
+            for (int max_length: {1, 2, 3, 8, 9, 10}) {
+                auto fast = Decoder((char *) bytes.data() + offset, bytes.size() - offset);
+                auto checked = Decoder((char *) bytes.data() + offset, bytes.size() - offset);
+
+                auto fast_result = fast.ReadVarint(max_length);
+                auto checked_result = checked.ReadVarintChecked(max_length);
+                ASSERT_EQ(fast_result, checked_result);
+                if (fast_result) {
+                    ASSERT_EQ(fast.data, checked.data);
+                }
+            }
+        }
+    }
+}
+
 TEST(Decoder, FixedInt) {
     unsigned char data[] = {0x00, 0x01, 0xFE, 0xFF};
     auto dec = Decoder((char *) data, 4);
@@ -237,6 +305,257 @@ TEST(Sketch, SerializationRoundtrip) {
     EXPECT_EQ(original.buckets, deserialized.buckets);
 }
 
+TEST(Sketch, WriteVarintMatchesEncodeVarint) {
+    for (uint64_t val: {0ULL, 1ULL, 127ULL, 128ULL, 255ULL, 16383ULL, 16384ULL, 1ULL << 56, ULLONG_MAX - 1, ULLONG_MAX}) {
+        auto expected = Sketch::EncodeVarint(val);
+
+        char buf[10];
+        auto end = Sketch::WriteVarint(buf, val);
+        EXPECT_EQ(std::vector<uint8_t>(buf, end), expected) << val;
+        EXPECT_EQ(Sketch::VarintSize(val), expected.size()) << val;
+    }
+}
+
+TEST(Sketch, SerializeMatchesEncoding) {
+    // Reference encoding built from EncodeVarint, as in the README
+    Sketch sketch = {
+            .metadata = {.version = 1, .sum = 8.8, .count = 300, .gamma = 1.020202},
+            .buckets = {{.key = 5, .count = 1},
+                        {.key = 40, .count = 200},
+                        {.key = 300, .count = 99}},
+    };
+
+    std::string expected;
+    expected.append((const char *) &sketch.metadata.version, 1);
+    expected.append((const char *) &sketch.metadata.gamma, 4);
+    expected.append((const char *) &sketch.metadata.sum, 4);
+    unsigned short prev_key = 0;
+    std::vector<uint64_t> varints = {sketch.metadata.count};
+    for (auto bucket: sketch.buckets) {
+        varints.push_back(bucket.key - prev_key);
+        varints.push_back(bucket.count);
+        prev_key = bucket.key;
+    }
+    for (auto varint: varints) {
+        auto bytes = Sketch::EncodeVarint(varint);
+        expected.append((const char *) bytes.data(), bytes.size());
+    }
+
+    EXPECT_EQ(sketch.Serialize(), expected);
+    EXPECT_EQ(sketch.SerializedSize(), expected.size());
+}
+
+unsigned char serialized_v2[] = {
+        0x02, // version = 2, 8-bit unsigned int
+        0xfb, 0x95, 0x82, 0x3f, // gamma = 1.020202, 32-bit float
+        0xcd, 0xcc, 0x0c, 0x41, // sum = 8.8, 32-bit float
+        0xf0, 0x02, // count = 368, varint
+        0x04, // bucket count = 4, varint
+
+        0b00000100, // key control, 1 bit per key: 2 byte delta for bucket 2
+        0b11000100, // count control, 2 bits per count: 1, 2, 1 and 8 bytes
+
+        0x05, // key = 5
+        0x23, // delta = 35 (key = 40)
+        0x2c, 0x01, // delta = 300 (key = 340), 16-bit
+        0x01, // delta = 1 (key = 341)
+
+        0x01, // count = 1
+        0x2c, 0x01, // count = 300, 16-bit
+        0x02, // count = 2
+        0x41, 0, 0, 0, 0, 0, 0, 0, // count = 65, 64-bit (not the smallest encoding, but allowed)
+};
+
+TEST(Decoder, MetadataAndBucketsV2) {
+    auto decoder = Decoder(reinterpret_cast<char *>(serialized_v2), sizeof(serialized_v2));
+
+    auto metadata = decoder.ReadMetadata();
+    EXPECT_TRUE(metadata.has_value());
+    EXPECT_EQ(metadata.value().version, 2);
+    EXPECT_EQ(metadata.value().count, 368);
+    EXPECT_EQ(decoder.MaxBucketsLeft(), 4);
+
+    std::vector<Bucket> buckets;
+    while (!decoder.Empty()) {
+        auto bucket = decoder.ReadBucket();
+        ASSERT_TRUE(bucket.has_value());
+        buckets.push_back(bucket.value());
+    }
+
+    std::vector<Bucket> expected_buckets = {{5, 1},
+                                            {40, 300},
+                                            {340, 2},
+                                            {341, 65}};
+    EXPECT_EQ(buckets, expected_buckets);
+}
+
+TEST(Decoder, InvalidV2) {
+    auto check_invalid = [](std::vector<unsigned char> bytes) {
+        auto decoder = Decoder((char *) bytes.data(), bytes.size());
+        return !decoder.ReadMetadata().has_value();
+    };
+    std::vector<unsigned char> bytes(serialized_v2, serialized_v2 + sizeof(serialized_v2));
+
+    EXPECT_FALSE(check_invalid(bytes));
+
+    // Truncated, or with trailing bytes
+    for (size_t length = 12; length < bytes.size(); length++) {
+        EXPECT_TRUE(check_invalid(std::vector<unsigned char>(bytes.begin(), bytes.begin() + length))) << length;
+    }
+    auto trailing = bytes;
+    trailing.push_back(0);
+    EXPECT_TRUE(check_invalid(trailing));
+
+    // Control bits set past the last bucket
+    auto key_control = bytes;
+    key_control[12] |= 0x80;
+    EXPECT_TRUE(check_invalid(key_control));
+    auto count_control = bytes;
+    count_control[11] = 3; // 3 buckets, so the last count code is unused
+    EXPECT_TRUE(check_invalid(count_control));
+
+    // Bucket count larger than the input
+    auto huge_count = bytes;
+    huge_count[11] = 0x7f;
+    EXPECT_TRUE(check_invalid(huge_count));
+}
+
+TEST(Sketch, SerializationRoundtripV2) {
+    std::vector<Bucket> buckets;
+    unsigned long long count = 0;
+    std::mt19937_64 rng(42);
+    unsigned short key = 0;
+    for (int i = 0; i < 1000; i++) {
+        key += 1 + (i % 10 == 0 ? 256 + rng() % 200 : rng() % 30); // some 2 byte deltas
+        auto bucket_count = rng() >> (12 + rng() % 52);
+        buckets.push_back({.key = key, .count = bucket_count + 1});
+        count += bucket_count + 1;
+    }
+
+    Sketch v1 = {.metadata = {.version = 1, .sum = 10.0, .count = count, .gamma = 1.1}, .buckets = buckets};
+    Sketch v2 = {.metadata = {.version = 2, .sum = 10.0, .count = count, .gamma = 1.1}, .buckets = buckets};
+
+    auto v2_bytes = v2.Serialize();
+    EXPECT_EQ(v2.SerializedSize(), v2_bytes.size());
+
+    auto deserialized = Sketch::Deserialize(v2_bytes.data(), v2_bytes.length());
+    ASSERT_TRUE(deserialized.has_value());
+    EXPECT_EQ(deserialized.value().metadata.version, 2);
+    EXPECT_EQ(deserialized.value().buckets, buckets);
+
+    // Both versions can be merged together, and keep the version of the first
+    auto v1_bytes = v1.Serialize();
+    Accumulator acc;
+    EXPECT_TRUE(acc.Merge(v2_bytes.data(), v2_bytes.length()));
+    EXPECT_TRUE(acc.Merge(v1_bytes.data(), v1_bytes.length()));
+    EXPECT_EQ(acc.metadata.value().version, 2);
+    EXPECT_EQ(acc.metadata.value().count, count * 2);
+
+    std::string acc_bytes(acc.SerializedSize(), '\0');
+    acc.SerializeTo(acc_bytes.data());
+    auto merged = Sketch::Deserialize(acc_bytes.data(), acc_bytes.length());
+    ASSERT_TRUE(merged.has_value());
+    EXPECT_EQ(merged.value().buckets.size(), buckets.size());
+    EXPECT_EQ(merged.value().buckets.front().count, buckets.front().count * 2);
+
+    auto view = SketchView::Deserialize(v2_bytes.data(), v2_bytes.length());
+    ASSERT_TRUE(view.has_value());
+    EXPECT_EQ(view.value().BucketCount(), buckets.size());
+    EXPECT_EQ(view.value().Quantile(0.5), v1.Quantile(0.5));
+}
+
+unsigned char serialized_v3[] = {
+        0x03, // version = 3, 8-bit unsigned int
+        0xfb, 0x95, 0x82, 0x3f, // gamma = 1.020202, 32-bit float
+        0xcd, 0xcc, 0x0c, 0x41, // sum = 8.8, 32-bit float
+        0x0a, // count = 10, varint
+
+        0x0a, // delta = 5 (key = 5), single bucket
+        0x01, // count = 1
+
+        0x47, // delta = 35 (key = 40), span
+        0x03, // span length = 3 (keys 40, 41, 42)
+        0x02, 0x03, 0x01, // counts
+
+        0x02, // delta = 1 (key = 43), single bucket
+        0x03, // count = 3
+};
+
+TEST(Decoder, MetadataAndBucketsV3) {
+    auto decoder = Decoder(reinterpret_cast<char *>(serialized_v3), sizeof(serialized_v3));
+
+    auto metadata = decoder.ReadMetadata();
+    EXPECT_TRUE(metadata.has_value());
+    EXPECT_EQ(metadata.value().version, 3);
+
+    std::vector<Bucket> buckets;
+    while (!decoder.Empty()) {
+        auto bucket = decoder.ReadBucket();
+        ASSERT_TRUE(bucket.has_value());
+        buckets.push_back(bucket.value());
+    }
+
+    std::vector<Bucket> expected_buckets = {{5, 1},
+                                            {40, 2},
+                                            {41, 3},
+                                            {42, 1},
+                                            {43, 3}};
+    EXPECT_EQ(buckets, expected_buckets);
+
+    // Truncated in the middle of a span
+    EXPECT_FALSE(Sketch::Deserialize(reinterpret_cast<char *>(serialized_v3), 15).has_value());
+    Accumulator acc;
+    EXPECT_FALSE(acc.Merge(reinterpret_cast<char *>(serialized_v3), 15));
+
+    // Span past the last key
+    unsigned char overflow[] = {0x03, 0xfb, 0x95, 0x82, 0x3f, 0xcd, 0xcc, 0x0c, 0x41, 0x02,
+                                0xfd, 0xff, 0x07, 0x02, 0x01, 0x01}; // key = 65534, length 2
+    EXPECT_TRUE(Sketch::Deserialize(reinterpret_cast<char *>(overflow), sizeof(overflow)).has_value());
+    overflow[13] = 0x03; // length 3
+    EXPECT_FALSE(Sketch::Deserialize(reinterpret_cast<char *>(overflow), sizeof(overflow)).has_value());
+}
+
+TEST(Sketch, SerializationRoundtripV3) {
+    std::vector<Bucket> buckets;
+    unsigned long long count = 0;
+    std::mt19937_64 rng(42);
+    unsigned short key = 0;
+    for (int i = 0; i < 1000; i++) {
+        key += rng() % 3 ? 1 : 1 + rng() % 300; // mostly runs of consecutive keys
+        buckets.push_back({.key = key, .count = 1 + rng() % 1000});
+        count += buckets.back().count;
+    }
+
+    Sketch v1 = {.metadata = {.version = 1, .sum = 10.0, .count = count, .gamma = 1.1}, .buckets = buckets};
+    Sketch v3 = {.metadata = {.version = 3, .sum = 10.0, .count = count, .gamma = 1.1}, .buckets = buckets};
+
+    auto v3_bytes = v3.Serialize();
+    EXPECT_EQ(v3.SerializedSize(), v3_bytes.size());
+    EXPECT_LT(v3_bytes.size(), v1.Serialize().size());
+
+    auto deserialized = Sketch::Deserialize(v3_bytes.data(), v3_bytes.length());
+    ASSERT_TRUE(deserialized.has_value());
+    EXPECT_EQ(deserialized.value().buckets, buckets);
+
+    // Spans are merged straight into the accumulator
+    Accumulator acc;
+    EXPECT_TRUE(acc.Merge(v3_bytes.data(), v3_bytes.length()));
+    EXPECT_EQ(acc.Buckets(), buckets);
+    EXPECT_TRUE(acc.Merge(v3_bytes.data(), v3_bytes.length()));
+    EXPECT_EQ(acc.Buckets().size(), buckets.size());
+    EXPECT_EQ(acc.Buckets().back().count, buckets.back().count * 2);
+
+    std::string acc_bytes(acc.SerializedSize(), '\0');
+    EXPECT_EQ(acc.SerializeTo(acc_bytes.data()), acc_bytes.data() + acc_bytes.size());
+
+    auto view = SketchView::Deserialize(v3_bytes.data(), v3_bytes.length());
+    ASSERT_TRUE(view.has_value());
+    EXPECT_EQ(view.value().BucketCount(), buckets.size());
+    for (double q: {0.0, 0.5, 0.99, 1.0}) {
+        EXPECT_EQ(view.value().Quantile(q), v1.Quantile(q));
+    }
+}
+
 TEST(Sketch, Quantile) {
     auto alpha = 0.01;
     auto gamma = float((1 + alpha) / (1 - alpha));
@@ -281,6 +600,547 @@ TEST(Sketch, Quantile) {
     EXPECT_LE(abs(sketch.Quantile(2) - 100), (100 * relative_error)); // Quantiles > 1 are treated as 1
 }
 
+TEST(Sketch, CumulativeCount) {
+    Sketch sketch = {
+            .metadata = {.version = 1, .sum = 8.8, .count = 10, .gamma = 1.020202},
+            .buckets = {{.key = 5, .count = 1},
+                        {.key = 40, .count = 2},
+                        {.key = 60, .count = 3},
+                        {.key = 61, .count = 4}},
+    };
+
+    // The same answers by scanning, and from the index once it is built
+    for (bool indexed: {false, true}) {
+        SCOPED_TRACE(indexed ? "indexed" : "scanned");
+        if (indexed) {
+            EXPECT_TRUE(sketch.cuml_counts.empty());
+            sketch.BuildIndex();
+            EXPECT_EQ(sketch.cuml_counts, (std::vector<unsigned long long>{1, 3, 6, 10}));
+        }
+        EXPECT_EQ(sketch.Indexed(), indexed);
+
+        EXPECT_EQ(sketch.CumulativeCount(0), 0);
+        EXPECT_EQ(sketch.CumulativeCount(5), 1);
+        EXPECT_EQ(sketch.CumulativeCount(39), 1);
+        EXPECT_EQ(sketch.CumulativeCount(40), 3);
+        EXPECT_EQ(sketch.CumulativeCount(60), 6);
+        EXPECT_EQ(sketch.CumulativeCount(USHRT_MAX), 10);
+
+        // Quantiles land on the first bucket whose cumulative count reaches the rank
+        EXPECT_EQ(sketch.QuantileKey(0), 5);
+        EXPECT_EQ(sketch.QuantileKey(0.1), 5);
+        EXPECT_EQ(sketch.QuantileKey(0.11), 5);
+        EXPECT_EQ(sketch.QuantileKey(0.3), 40);
+        EXPECT_EQ(sketch.QuantileKey(0.31), 40);
+        EXPECT_EQ(sketch.QuantileKey(0.6), 60);
+        EXPECT_EQ(sketch.QuantileKey(0.66), 61);
+        EXPECT_EQ(sketch.QuantileKey(2), 61);
+
+        std::vector<double> qs = {0.66, 0, 0.3, 2};
+        QuantileQuery query;
+        query.Set(qs.data(), qs.size());
+        sketch.Quantiles(query);
+        for (size_t i = 0; i < qs.size(); i++) {
+            EXPECT_EQ(query.values[i], sketch.Quantile(qs[i])) << "q = " << qs[i];
+        }
+    }
+
+    Sketch empty = {.metadata = sketch.metadata, .buckets = {}};
+    EXPECT_EQ(empty.CumulativeCount(5), 0);
+    EXPECT_EQ(empty.QuantileKey(0.5), 0);
+    empty.BuildIndex();
+    EXPECT_FALSE(empty.Indexed());
+    EXPECT_EQ(empty.QuantileKey(0.5), 0);
+}
+
+TEST(SketchView, Deserialize) {
+    auto view_result = SketchView::Deserialize(reinterpret_cast<char *>(serialized), sizeof(serialized));
+    EXPECT_TRUE(view_result.has_value());
+    auto view = view_result.value();
+
+    EXPECT_EQ(view.metadata.version, 1);
+    EXPECT_FLOAT_EQ(view.metadata.sum, 8.8);
+    EXPECT_EQ(view.metadata.count, 4);
+    EXPECT_FLOAT_EQ(view.metadata.gamma, 1.020202);
+    EXPECT_TRUE(view.Valid());
+    EXPECT_EQ(view.BucketCount(), 3);
+
+    std::vector<Bucket> buckets;
+    for (auto bucket: view) {
+        buckets.push_back(bucket);
+    }
+    std::vector<Bucket> expected_buckets = {{5, 1},
+                                            {40, 2},
+                                            {60, 1}};
+    EXPECT_EQ(buckets, expected_buckets);
+
+    auto sketch = Sketch::Deserialize(reinterpret_cast<char *>(serialized), sizeof(serialized)).value();
+    EXPECT_EQ(view.JSON(), sketch.JSON());
+    EXPECT_EQ(view.Inspect(), sketch.Inspect());
+}
+
+TEST(SketchView, JSON) {
+    auto view = SketchView::Deserialize(reinterpret_cast<char *>(serialized), sizeof(serialized)).value();
+
+    EXPECT_EQ(view.JSON(), "{\"version\":1,\"sum\":8.8,\"count\":4,\"gamma\":1.020202,"
+                           "\"buckets\":{\"5\":1,\"40\":2,\"60\":1}}");
+    EXPECT_EQ(view.Inspect(), "Sketch<version: 1, sum:8.8, count:4, gamma:1.0202, bucket_count: 3, "
+                              "buckets:{5: 1, 40: 2, 60: 1, }>");
+
+    // Inspect prints floats like ostream always printed them
+    for (float sum: {0.0f, 1e-7f, 121.0f, 1234567.0f, 3.4e38f}) {
+        Sketch sketch = {.metadata = {.version = 2, .sum = sum, .count = 1, .gamma = 1.5},
+                         .buckets = {{.key = USHRT_MAX, .count = ULLONG_MAX}}};
+        std::ostringstream expected;
+        expected << "Sketch<version: 2, sum:" << sum << ", count:1, gamma:1.5, bucket_count: 1, buckets:{"
+                 << USHRT_MAX << ": " << ULLONG_MAX << ", }>";
+        EXPECT_EQ(sketch.Inspect(), expected.str());
+    }
+
+    std::string out = "reused";
+    view.JSON(out);
+    EXPECT_EQ(out, view.JSON());
+}
+
+TEST(Sketch, FromJSON) {
+    for (float sum: {0.0f, 1e-7f, 8.8f, 1234567.0f, 3.4e38f}) {
+        Sketch sketch = {.metadata = {.version = 3, .sum = sum, .count = 4, .gamma = (float) KeyMapper::Gamma(0.01)},
+                         .buckets = {{.key = 0, .count = 1}, {.key = 40, .count = 2}, {.key = USHRT_MAX, .count = ULLONG_MAX}}};
+        auto json = sketch.JSON();
+        auto parsed = Sketch::FromJSON(json.data(), json.size());
+        ASSERT_TRUE(parsed) << json;
+        EXPECT_EQ(parsed.value().Serialize(), sketch.Serialize()) << json;
+    }
+
+    std::string spaced = " { \"version\" : 1 ,\n\"sum\": 8.5, \"count\": 3, \"gamma\": 2,\n"
+                         "  \"buckets\": { \"1\": 1, \"7\": 2 } }\n";
+    auto parsed = Sketch::FromJSON(spaced.data(), spaced.size());
+    ASSERT_TRUE(parsed);
+    EXPECT_EQ(parsed.value().metadata.sum, 8.5);
+    EXPECT_EQ(parsed.value().metadata.count, 3);
+    std::vector<Bucket> expected_buckets = {{1, 1}, {7, 2}};
+    EXPECT_EQ(parsed.value().buckets, expected_buckets);
+
+    for (std::string invalid: {
+            "",
+            "{}",
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{}}", // no buckets
+            "{\"version\":4,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{\"1\":1}}", // unknown version
+            "{\"version\":1,\"sum\":1,\"count\":0,\"gamma\":2,\"buckets\":{\"1\":1}}", // no values
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":1,\"buckets\":{\"1\":1}}", // gamma not > 1
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":inf,\"buckets\":{\"1\":1}}",
+            "{\"version\":1,\"sum\":1,\"count\":1.5,\"gamma\":2,\"buckets\":{\"1\":1}}",
+            "{\"sum\":1,\"version\":1,\"count\":1,\"gamma\":2,\"buckets\":{\"1\":1}}", // out of order
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{\"2\":1,\"1\":1}}", // keys out of order
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{\"65536\":1}}", // key too large
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{\"1\":-1}}",
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{1:1}}", // unquoted key
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{\"1\":1,}}",
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{\"1\":1}}x",
+            "{\"version\":1,\"sum\":1,\"count\":1,\"gamma\":2,\"buckets\":{\"1\":1}",
+    }) {
+        EXPECT_FALSE(Sketch::FromJSON(invalid.data(), invalid.size())) << invalid;
+    }
+}
+
+TEST(SketchView, CompactJSON) {
+    Sketch sketch = {.metadata = {.version = 1, .sum = 8.5, .count = 4, .gamma = 2},
+                     .buckets = {{.key = 0, .count = 1}, {.key = 2, .count = 2}, {.key = 3, .count = 1}}};
+    auto serialized_sketch = sketch.Serialize();
+    auto view = SketchView::Deserialize(serialized_sketch.data(), serialized_sketch.size()).value();
+
+    std::string out;
+    EXPECT_TRUE(view.CompactJSON(out, nullptr));
+    EXPECT_EQ(out, "{\"count\":4,\"sum\":8.5,\"gamma\":2,\"buckets\":[[0.5,1,1],[2,4,2],[4,8,1]]}");
+
+    QuantileQuery query;
+    std::vector<double> qs = {0.9, 0.1};
+    query.Set(qs.data(), qs.size());
+    EXPECT_TRUE(view.CompactJSON(out, &query));
+    EXPECT_EQ(out, "{\"count\":4,\"sum\":8.5,\"gamma\":2,\"quantiles\":[5.333333333333333,0.6666666666666666]}");
+
+    // Bounds and quantiles past the range of a double are null, as JSON has
+    // no infinity
+    Sketch huge = {.metadata = {.version = 1, .sum = 10, .count = 2, .gamma = 2},
+                   .buckets = {{.key = 3, .count = 1}, {.key = 2000, .count = 1}}};
+    serialized_sketch = huge.Serialize();
+    view = SketchView::Deserialize(serialized_sketch.data(), serialized_sketch.size()).value();
+    EXPECT_TRUE(view.CompactJSON(out, nullptr));
+    EXPECT_EQ(out, "{\"count\":2,\"sum\":10,\"gamma\":2,\"buckets\":[[4,8,1],[null,null,1]]}");
+    EXPECT_TRUE(view.CompactJSON(out, &query));
+    EXPECT_EQ(out, "{\"count\":2,\"sum\":10,\"gamma\":2,\"quantiles\":[null,5.333333333333333]}");
+}
+
+TEST(Sketch, AddSerialized) {
+    Sketch sketch = {.metadata = {.version = 1, .sum = 100, .count = 6, .gamma = 1.02},
+                     .buckets = {{.key = 10, .count = 1}, {.key = 20, .count = 2}, {.key = 300, .count = 3}}};
+
+    // Before, between, on and after the existing keys, with counts that
+    // change the length of the count varints
+    for (unsigned char version: {1, 2, 3}) {
+        for (unsigned short key: {0, 5, 10, 15, 20, 299, 300, 301, USHRT_MAX}) {
+            for (unsigned long long count: {1ULL, 127ULL, 1ULL << 40}) {
+                Metadata versioned_metadata = sketch.metadata;
+                versioned_metadata.version = version;
+                Sketch versioned = {.metadata = versioned_metadata, .buckets = sketch.buckets};
+                auto serialized = versioned.Serialize();
+
+                std::string out;
+                ASSERT_TRUE(Sketch::AddSerialized(serialized.data(), serialized.size(), {key, count}, 2.5 * count, out));
+
+                Accumulator acc;
+                acc.Merge(versioned);
+                acc.Add(key, count);
+                Metadata metadata = versioned.metadata;
+                metadata.sum = (float) (metadata.sum + 2.5 * count);
+                metadata.count += count;
+                Sketch expected = {.metadata = metadata, .buckets = acc.Buckets()};
+
+                EXPECT_EQ(out, expected.Serialize()) << (int) version << " " << key << " " << count;
+            }
+        }
+    }
+
+    auto serialized = sketch.Serialize();
+    std::string out;
+    EXPECT_FALSE(Sketch::AddSerialized(serialized.data(), 10, {1, 1}, 1, out));
+    EXPECT_FALSE(Sketch::AddSerialized(serialized.data(), serialized.size(), {1, ULLONG_MAX}, 1, out));
+
+    // A corrupt bucket after the added key is rejected, though it is copied
+    // rather than rewritten
+    auto truncated = serialized;
+    truncated.back() = (char) 0x80;
+    ASSERT_FALSE(Sketch::Deserialize(truncated.data(), truncated.size()));
+    EXPECT_FALSE(Sketch::AddSerialized(truncated.data(), truncated.size(), {1, 1}, 1, out));
+}
+
+TEST(SketchView, CumulativeCount) {
+    Sketch sketch = {.metadata = {.version = 1, .sum = 100, .count = 10, .gamma = 1.02},
+                     .buckets = {{.key = 10, .count = 1}, {.key = 20, .count = 2}, {.key = 30, .count = 7}}};
+
+    for (unsigned char version: {1, 2, 3}) {
+        Metadata metadata = sketch.metadata;
+        metadata.version = version;
+        auto serialized = Sketch{.metadata = metadata, .buckets = sketch.buckets}.Serialize();
+        auto view = SketchView::Deserialize(serialized.data(), serialized.size()).value();
+
+        for (unsigned short key: {0, 9, 10, 19, 20, 29, 30, USHRT_MAX}) {
+            EXPECT_EQ(view.CumulativeCount(key), sketch.CumulativeCount(key)) << key;
+        }
+
+        // Stops at the first bucket that reaches the limit
+        EXPECT_EQ(view.CumulativeCount(USHRT_MAX, 1), 1);
+        EXPECT_EQ(view.CumulativeCount(USHRT_MAX, 2), 3);
+        EXPECT_EQ(view.CumulativeCount(15, 2), 1);
+    }
+
+    // Buckets past the key or the limit aren't decoded
+    auto serialized = sketch.Serialize();
+    serialized.push_back('\xff');
+    auto view = SketchView::Deserialize(serialized.data(), serialized.size()).value();
+    EXPECT_EQ(view.CumulativeCount(20), 3);
+    EXPECT_EQ(view.CumulativeCount(USHRT_MAX), std::nullopt);
+}
+
+TEST(SketchView, Invalid) {
+    // Metadata only, no buckets
+    EXPECT_FALSE(SketchView::Deserialize(reinterpret_cast<char *>(serialized), 10).has_value());
+    EXPECT_FALSE(SketchView::Deserialize(reinterpret_cast<char *>(serialized), 5).has_value());
+
+    // Truncated in the middle of a bucket
+    auto view = SketchView::Deserialize(reinterpret_cast<char *>(serialized), sizeof(serialized) - 1);
+    EXPECT_TRUE(view.has_value());
+    EXPECT_FALSE(view.value().Valid());
+    EXPECT_EQ(view.value().BucketCount(), std::nullopt);
+
+    // Quantiles before the truncated bucket can still be answered, later ones can't
+    EXPECT_TRUE(view.value().Quantile(0.5).has_value());
+    EXPECT_FALSE(view.value().Quantile(1).has_value());
+}
+
+TEST(SketchView, QuantileMatchesSketch) {
+    std::vector<Bucket> buckets;
+    unsigned long long count = 0;
+    for (unsigned short key = 10; key < 400; key += 3) {
+        buckets.push_back({.key = key, .count = (unsigned long long) key % 7 + 1});
+        count += key % 7 + 1;
+    }
+
+    Sketch sketch = {
+            .metadata = {.version = 1, .sum = 100, .count = count, .gamma = 1.02},
+            .buckets = buckets,
+    };
+    auto bytes = sketch.Serialize();
+    auto view = SketchView::Deserialize(bytes.data(), bytes.length()).value();
+
+    for (double q: {-1.0, 0.0, 0.001, 0.1, 0.5, 0.9, 0.99, 0.999, 1.0, 2.0}) {
+        EXPECT_EQ(view.Quantile(q), sketch.Quantile(q)) << "q = " << q;
+    }
+}
+
+TEST(KeyMapper, MatchesLog) {
+    for (double alpha: {0.001, 0.01, 0.05, 0.3}) {
+        auto gamma = KeyMapper::Gamma(alpha);
+        KeyMapper mapper(gamma);
+
+        std::mt19937_64 rng(42);
+        std::lognormal_distribution<double> dist(8, 4);
+        for (int i = 0; i < 100000; i++) {
+            double value = dist(rng);
+            auto expected = value <= 1 ? 0.0 : ceil(log(value) / log(gamma));
+            auto key = mapper.Key(value);
+
+            if (expected > USHRT_MAX) {
+                EXPECT_EQ(key, std::nullopt);
+                continue;
+            }
+
+            ASSERT_TRUE(key.has_value());
+            if (key.value() != expected) {
+                // Only values on a bucket bound may round either way
+                EXPECT_NEAR(log(value) / log(gamma), key.value(), 1e-9) << "value = " << value;
+            }
+        }
+    }
+}
+
+TEST(KeyMapper, Limits) {
+    KeyMapper mapper(KeyMapper::Gamma(0.01));
+
+    EXPECT_EQ(mapper.Key(0), 0);
+    EXPECT_EQ(mapper.Key(0.5), 0);
+    EXPECT_EQ(mapper.Key(1), 0);
+    EXPECT_EQ(mapper.Key(10), 116);
+    EXPECT_EQ(mapper.Key(100), 231);
+    EXPECT_EQ(mapper.Key(DBL_MAX), (unsigned short) ceil(log(DBL_MAX) / log(mapper.gamma)));
+
+    EXPECT_EQ(mapper.Key(-1), std::nullopt);
+    EXPECT_EQ(mapper.Key(std::numeric_limits<double>::quiet_NaN()), std::nullopt);
+    EXPECT_EQ(mapper.Key(std::numeric_limits<double>::infinity()), std::nullopt);
+
+    // Keys past 16 bits can't be represented
+    KeyMapper fine_mapper(KeyMapper::Gamma(0.00001));
+    EXPECT_EQ(fine_mapper.Key(1e300), std::nullopt);
+}
+
+TEST(KeyMapper, TopKey) {
+    // Values in the last bucket, whose estimate may be one past USHRT_MAX
+    for (double alpha: {0.0001, 0.0002, 0.0005}) {
+        KeyMapper mapper(KeyMapper::Gamma(alpha));
+        double lower = pow(mapper.gamma, USHRT_MAX - 1.0);
+        double upper = pow(mapper.gamma, (double) USHRT_MAX);
+
+        for (int i = 1; i <= 1000; i++) {
+            double value = lower + (upper - lower) * i / 1000;
+            EXPECT_EQ(mapper.Key(value), USHRT_MAX) << "alpha = " << alpha << ", value = " << value;
+
+            unsigned short key = 0;
+            ASSERT_TRUE(mapper.Keys(&value, 1, &key));
+            EXPECT_EQ(key, USHRT_MAX);
+        }
+
+        EXPECT_EQ(mapper.Key(std::nextafter(upper, DBL_MAX)), std::nullopt) << "alpha = " << alpha;
+    }
+}
+
+TEST(KeyMapper, Keys) {
+    KeyMapper mapper(KeyMapper::Gamma(0.01));
+
+    // More than a batch, with values on both sides of 1
+    std::mt19937_64 rng(7);
+    std::lognormal_distribution<double> dist(3, 3);
+    std::vector<double> values(1000);
+    for (auto &value: values) {
+        value = dist(rng);
+    }
+    values[0] = 0;
+    values[1] = 1;
+    values[2] = DBL_MAX;
+
+    std::vector<unsigned short> keys(values.size());
+    ASSERT_TRUE(mapper.Keys(values.data(), values.size(), keys.data()));
+    for (size_t i = 0; i < values.size(); i++) {
+        EXPECT_EQ(keys[i], mapper.Key(values[i])) << values[i];
+    }
+
+    for (double invalid: {-1.0, std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::infinity()}) {
+        values[500] = invalid;
+        EXPECT_FALSE(mapper.Keys(values.data(), values.size(), keys.data())) << invalid;
+    }
+}
+
+TEST(ValueTable, MatchesValue) {
+    ValueTable table;
+    Metadata metadata = {.version = 1, .count = 1, .gamma = 1.02};
+
+    for (unsigned short key: {0, 10, 5, 1000, 999}) {
+        EXPECT_EQ(table.Value(metadata, key), metadata.Value(key));
+    }
+    EXPECT_EQ(table.values[0].size(), 1001);
+
+    // Other gammas get their own tables, and alternating doesn't reset them
+    for (int round = 0; round < 2; round++) {
+        for (float gamma: {1.5f, 1.02f, 1.1f, 1.2f}) {
+            metadata.gamma = gamma;
+            EXPECT_EQ(table.Value(metadata, 10), metadata.Value(10));
+        }
+    }
+    EXPECT_EQ(table.values[0].size(), 1001);
+    EXPECT_EQ(table.values[1].size(), 11);
+    EXPECT_EQ(table.values[3].size(), 11);
+
+    // Past the last table values are computed directly
+    metadata.gamma = 1.3;
+    EXPECT_EQ(table.Value(metadata, 20), metadata.Value(20));
+    for (auto &values: table.values) {
+        EXPECT_LE(values.size(), 1001);
+    }
+}
+
+TEST(GammaRemapper, Power) {
+    float from = 1.02;
+    GammaRemapper same(from, from);
+    EXPECT_EQ(same.power, 1);
+    EXPECT_EQ(same.Remap({.key = 300, .count = 5})[1], (Bucket{.key = 300, .count = 5}));
+
+    // Bucket k of from covers buckets 2k - 1 and 2k of from ^ 2
+    GammaRemapper squared(from, from * from);
+    EXPECT_EQ(squared.power, 2);
+    for (unsigned short key: {0, 1, 2, 3, 4, 301, 65535}) {
+        auto remapped = squared.Remap({.key = key, .count = 7});
+        EXPECT_EQ(remapped[0].count, 0);
+        EXPECT_EQ(remapped[1], (Bucket{.key = (unsigned short) ((key + 1) / 2), .count = 7})) << key;
+    }
+
+    EXPECT_EQ(GammaRemapper(from, 1.05).power, 0);
+}
+
+TEST(GammaRemapper, Split) {
+    GammaRemapper remapper((float) KeyMapper::Gamma(0.01), (float) KeyMapper::Gamma(0.025));
+    EXPECT_EQ(remapper.power, 0);
+    EXPECT_GT(remapper.ratio, 0.39);
+    EXPECT_LT(remapper.ratio, 0.41);
+
+    for (unsigned short key = 0; key < 2000; key++) {
+        auto remapped = remapper.Remap({.key = key, .count = 1000});
+        EXPECT_EQ(remapped[0].count + remapped[1].count, 1000);
+        EXPECT_LE(remapped[1].key, key);
+        EXPECT_EQ(remapped[1].key, (unsigned short) ceil(key * remapper.ratio)) << key;
+        if (remapped[0].count) {
+            EXPECT_EQ(remapped[0].key + 1, remapped[1].key);
+        }
+    }
+}
+
+TEST(Accumulator, MergeConvertsGamma) {
+    double fine_alpha = 0.01;
+    double coarse_alpha = 0.025;
+    float fine = KeyMapper::Gamma(fine_alpha);
+    float coarse = KeyMapper::Gamma(coarse_alpha);
+
+    std::vector<double> values;
+    std::map<unsigned short, unsigned long long> fine_buckets;
+    std::mt19937_64 rng(7);
+    for (int i = 0; i < 10000; i++) {
+        values.push_back(exp(std::uniform_real_distribution<double>(0, 12)(rng)));
+        fine_buckets[(unsigned short) ceil(log(values.back()) / log(fine))]++;
+    }
+    std::sort(values.begin(), values.end());
+
+    std::vector<Bucket> buckets;
+    for (auto [key, count]: fine_buckets) {
+        buckets.push_back({.key = key, .count = count});
+    }
+    auto bytes = Sketch{
+            .metadata = {.version = 1, .sum = 10.0, .count = values.size(), .gamma = fine},
+            .buckets = buckets,
+    }.Serialize();
+
+    Accumulator acc;
+    EXPECT_TRUE(acc.Merge(bytes.data(), bytes.length(), coarse));
+    EXPECT_TRUE(acc.Merge(bytes.data(), bytes.length(), coarse));
+    auto sketch = acc.ToSketch();
+    EXPECT_EQ(sketch.metadata.gamma, coarse);
+    EXPECT_EQ(sketch.metadata.count, 2 * values.size());
+    EXPECT_FLOAT_EQ(sketch.metadata.sum, 20.0);
+    EXPECT_EQ(sketch.CumulativeCount(USHRT_MAX), 2 * values.size());
+
+    for (double q: {0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99}) {
+        auto expected = values[(size_t) llround(q * values.size()) - 1];
+        EXPECT_NEAR(sketch.Quantile(q), expected, expected * (fine_alpha + coarse_alpha)) << "q = " << q;
+    }
+
+    // Sketches can't be converted to a finer gamma, or merged with a different target
+    Accumulator finer;
+    auto coarse_bytes = sketch.Serialize();
+    EXPECT_FALSE(finer.Merge(coarse_bytes.data(), coarse_bytes.length(), fine));
+    EXPECT_FALSE(acc.Merge(bytes.data(), bytes.length(), KeyMapper::Gamma(0.05)));
+}
+
+TEST(QuantileQuery, MatchesQuantile) {
+    std::vector<Bucket> buckets;
+    unsigned long long count = 0;
+    for (unsigned short key = 3; key < 500; key += 5) {
+        buckets.push_back({.key = key, .count = (unsigned long long) key % 11 + 1});
+        count += key % 11 + 1;
+    }
+
+    Sketch sketch = {
+            .metadata = {.version = 1, .sum = 100, .count = count, .gamma = 1.02},
+            .buckets = buckets,
+    };
+    auto bytes = sketch.Serialize();
+    auto view = SketchView::Deserialize(bytes.data(), bytes.length()).value();
+    Accumulator acc;
+    EXPECT_TRUE(acc.Merge(bytes.data(), bytes.length()));
+
+    // Unsorted and out of range quantiles, with duplicates
+    std::vector<double> qs = {0.99, 0.5, -1, 0.999, 2, 0.5, 0, 0.9};
+
+    QuantileQuery query;
+    query.Set(qs.data(), qs.size());
+
+    sketch.Quantiles(query);
+    for (size_t i = 0; i < qs.size(); i++) {
+        EXPECT_EQ(query.values[i], sketch.Quantile(qs[i])) << "q = " << qs[i];
+    }
+
+    EXPECT_TRUE(view.Quantiles(query));
+    for (size_t i = 0; i < qs.size(); i++) {
+        EXPECT_EQ(query.values[i], sketch.Quantile(qs[i])) << "q = " << qs[i];
+    }
+
+    acc.Quantiles(query);
+    for (size_t i = 0; i < qs.size(); i++) {
+        EXPECT_EQ(query.values[i], sketch.Quantile(qs[i])) << "q = " << qs[i];
+    }
+}
+
+TEST(QuantileQuery, JSON) {
+    Sketch sketch = {
+            .metadata = {.version = 1, .sum = 10, .count = 4, .gamma = 2},
+            .buckets = {{.key = 0, .count = 2},
+                        {.key = 3, .count = 2}},
+    };
+
+    std::vector<double> qs = {1, 0.5};
+    QuantileQuery query;
+    query.Set(qs.data(), qs.size());
+    sketch.Quantiles(query);
+
+    // 2 * 2^key / 3
+    EXPECT_EQ(query.JSON(), "[5.333333333333333,0.6666666666666666]");
+
+    // A quantile past the range of a double is null, as JSON has no infinity
+    Sketch huge = {
+            .metadata = {.version = 1, .sum = 10, .count = 4, .gamma = 2},
+            .buckets = {{.key = 3, .count = 2},
+                        {.key = 2000, .count = 2}},
+    };
+    huge.Quantiles(query);
+    EXPECT_EQ(query.JSON(), "[null,5.333333333333333]");
+}
+
 TEST(Accumulator, Merge) {
     auto sketch_a_bytes = Sketch({
                                          .metadata = {
@@ -313,7 +1173,7 @@ TEST(Accumulator, Merge) {
 
     Accumulator acc;
     Metadata metadata;
-    std::unordered_map<unsigned short, unsigned long long> expected_buckets;
+    std::vector<Bucket> expected_buckets;
 
     EXPECT_TRUE(acc.Merge(sketch_a_bytes.data(), sketch_a_bytes.length()));
 
@@ -326,7 +1186,7 @@ TEST(Accumulator, Merge) {
     expected_buckets = {{1, 1},
                         {2, 2},
                         {3, 3}};
-    EXPECT_EQ(acc.buckets, expected_buckets);
+    EXPECT_EQ(acc.Buckets(), expected_buckets);
 
     EXPECT_TRUE(acc.Merge(sketch_b_bytes.data(), sketch_b_bytes.length()));
 
@@ -340,7 +1200,162 @@ TEST(Accumulator, Merge) {
                         {2, 4},
                         {3, 6},
                         {4, 4}};
-    EXPECT_EQ(acc.buckets, expected_buckets);
+    EXPECT_EQ(acc.Buckets(), expected_buckets);
+}
+
+TEST(Accumulator, MergeSketch) {
+    Sketch sketch_a = {
+            .metadata = {.version = 1, .sum = 10.0, .count = 3, .gamma = 1.1},
+            .buckets = {{.key = 1, .count = 1},
+                        {.key = 2, .count = 2}},
+    };
+    Sketch sketch_b = {
+            .metadata = {.version = 1, .sum = 20.0, .count = 5, .gamma = 1.1},
+            .buckets = {{.key = 2, .count = 2},
+                        {.key = 9, .count = 3}},
+    };
+    auto sketch_b_bytes = sketch_b.Serialize();
+
+    Accumulator from_bytes;
+    auto sketch_a_bytes = sketch_a.Serialize();
+    EXPECT_TRUE(from_bytes.Merge(sketch_a_bytes.data(), sketch_a_bytes.length()));
+    EXPECT_TRUE(from_bytes.Merge(sketch_b_bytes.data(), sketch_b_bytes.length()));
+
+    Accumulator acc;
+    EXPECT_TRUE(acc.Merge(sketch_a));
+    EXPECT_TRUE(acc.Merge(sketch_b_bytes.data(), sketch_b_bytes.length()));
+    EXPECT_EQ(acc.ToSketch().Serialize(), from_bytes.ToSketch().Serialize());
+
+    Sketch other_gamma = {
+            .metadata = {.version = 1, .sum = 1.0, .count = 1, .gamma = 1.2},
+            .buckets = {{.key = 1, .count = 1}},
+    };
+    EXPECT_FALSE(acc.Merge(other_gamma));
+}
+
+TEST(Accumulator, MergeMany) {
+    std::mt19937_64 rng(13);
+    std::vector<std::string> serialized;
+    for (int i = 0; i < 3000; i++) {
+        std::vector<Bucket> buckets;
+        unsigned long long count = 0;
+        unsigned short key = rng() % 2000;
+        for (int b = 0; b < 1 + (int) (rng() % 20); b++) {
+            key += 1 + rng() % 50;
+            buckets.push_back({.key = key, .count = 1 + rng() % 100});
+            count += buckets.back().count;
+        }
+        Sketch sketch = {
+                .metadata = {.version = (unsigned char) (1 + i % 3), .sum = (float) (rng() % 100000) / 7.0f,
+                             .count = count, .gamma = 1.02},
+                .buckets = buckets,
+        };
+        serialized.push_back(sketch.Serialize());
+    }
+    std::vector<std::string_view> sketches(serialized.begin(), serialized.end());
+
+    Accumulator sequential;
+    for (auto &sketch: serialized) {
+        ASSERT_TRUE(sequential.Merge(sketch.data(), sketch.length()));
+    }
+    auto expected = sequential.ToSketch().Serialize();
+
+    for (unsigned int threads: {0, 1, 2, 3, 4, 7, 8, 16}) {
+        Accumulator acc;
+        EXPECT_TRUE(acc.MergeMany(sketches, threads));
+        EXPECT_EQ(acc.ToSketch().Serialize(), expected) << threads << " threads";
+    }
+
+    // Merged on top of what the accumulator already has
+    Accumulator first;
+    ASSERT_TRUE(first.Merge(serialized[0].data(), serialized[0].length()));
+    EXPECT_TRUE(first.MergeMany({sketches.begin() + 1, sketches.end()}, 4));
+    EXPECT_EQ(first.ToSketch().Serialize(), expected);
+
+    Accumulator empty;
+    EXPECT_TRUE(empty.MergeMany({}, 4));
+    EXPECT_TRUE(empty.Empty());
+
+    // Any invalid or unmergeable sketch fails the whole merge
+    auto other_gamma = Sketch{
+            .metadata = {.version = 1, .sum = 1, .count = 1, .gamma = 1.1},
+            .buckets = {{.key = 1, .count = 1}},
+    }.Serialize();
+    for (std::string_view bad: {std::string_view("bogus"), std::string_view(other_gamma)}) {
+        auto with_bad = sketches;
+        with_bad[2000] = bad;
+        Accumulator acc;
+        EXPECT_FALSE(acc.MergeMany(with_bad, 4));
+    }
+}
+
+TEST(Accumulator, SerializeTo) {
+    Accumulator acc;
+    acc.metadata = Metadata{.version = 1, .sum = 1, .count = 6, .gamma = 1.1};
+    acc.Add(3, 1);
+    acc.Add(500, 300);
+    acc.Add(200, 2);
+
+    auto expected = acc.ToSketch().Serialize();
+    EXPECT_EQ(acc.SerializedSize(), expected.size());
+
+    std::string out(acc.SerializedSize(), '\0');
+    EXPECT_EQ(acc.SerializeTo(out.data()), out.data() + out.size());
+    EXPECT_EQ(out, expected);
+}
+
+TEST(Accumulator, SerializeAllEmpty) {
+    Sketch sketch = {.metadata = {.version = 1, .sum = 0, .count = 1, .gamma = 1.02},
+                     .buckets = {{3, 0}, {6, 0}}};
+    std::string serialized = sketch.Serialize();
+
+    Accumulator acc;
+    ASSERT_TRUE(acc.Merge(serialized.data(), serialized.size()));
+
+    // The first of the empty buckets is kept so the result still deserializes
+    std::vector<Bucket> expected = {{3, 0}};
+    EXPECT_EQ(acc.Buckets(), expected);
+    EXPECT_EQ(acc.ToSketch().buckets, expected);
+
+    std::string out(acc.SerializedSize(), '\0');
+    EXPECT_EQ(acc.SerializeTo(out.data()), out.data() + out.size());
+    auto deserialized = Sketch::Deserialize(out.data(), out.size());
+    ASSERT_TRUE(deserialized);
+    EXPECT_EQ(deserialized.value().buckets, expected);
+}
+
+TEST(Accumulator, Collapse) {
+    Accumulator acc;
+    acc.metadata = Metadata{.version = 1, .sum = 1, .count = 15, .gamma = 1.1};
+    acc.Add(1, 1);
+    acc.Add(4, 2);
+    acc.Add(10, 3);
+    acc.Add(11, 4);
+    acc.Add(30, 5);
+
+    // Already within bounds
+    acc.Collapse(5);
+    EXPECT_EQ(acc.Buckets().size(), 5);
+
+    acc.Collapse(3);
+    std::vector<Bucket> expected_buckets = {{10, 6},
+                                            {11, 4},
+                                            {30, 5}};
+    EXPECT_EQ(acc.Buckets(), expected_buckets);
+    EXPECT_EQ(acc.min_key, 10);
+    EXPECT_EQ(acc.metadata.value().count, 15);
+
+    // Upper quantiles are unchanged
+    QuantileQuery query;
+    std::vector<double> qs = {0.5, 0.99};
+    query.Set(qs.data(), qs.size());
+    acc.Quantiles(query);
+    EXPECT_EQ(query.values[0], acc.metadata.value().Value(11));
+    EXPECT_EQ(query.values[1], acc.metadata.value().Value(30));
+
+    acc.Collapse(1);
+    expected_buckets = {{30, 15}};
+    EXPECT_EQ(acc.Buckets(), expected_buckets);
 }
 
 TEST(Accumulator, MergeInvalid) {
@@ -353,15 +1368,246 @@ TEST(Accumulator, MergeInvalid) {
     EXPECT_FALSE(acc.Merge(reinterpret_cast<char *>(too_short), sizeof(too_short)));
 }
 
+TEST(Accumulator, AddGrowsWindow) {
+    Accumulator acc;
+
+    acc.Add(1000, 1);
+    acc.Add(5, 2);     // below the window
+    acc.Add(65535, 3); // above the window
+    acc.Add(1000, 4);
+
+    EXPECT_EQ(acc.min_key, 5);
+    EXPECT_EQ(acc.max_key, 65535);
+    EXPECT_LE(acc.base, 5);
+    EXPECT_EQ(acc.base + acc.counts.size(), 65536);
+
+    std::vector<Bucket> expected_buckets = {{5, 2},
+                                            {1000, 5},
+                                            {65535, 3}};
+    EXPECT_EQ(acc.Buckets(), expected_buckets);
+}
+
+TEST(Accumulator, ToSketchMatchesMap) {
+    // Merge sketches with scattered keys and check against a reference map
+    std::map<unsigned short, unsigned long long> reference;
+    Accumulator acc;
+
+    for (int i = 0; i < 50; i++) {
+        std::map<unsigned short, unsigned long long> sketch_buckets;
+        for (int j = 0; j < 20; j++) {
+            sketch_buckets[(unsigned short) ((i * 7919 + j * 104729) % 3000)] += j + 1;
+        }
+
+        std::vector<Bucket> buckets;
+        for (auto [key, count]: sketch_buckets) {
+            buckets.push_back({.key = key, .count = count});
+            reference[key] += count;
+        }
+
+        auto bytes = Sketch{.metadata = {.version = 1, .sum = 1, .count = 1, .gamma = 1.1}, .buckets = buckets}.Serialize();
+        EXPECT_TRUE(acc.Merge(bytes.data(), bytes.length()));
+    }
+
+    std::vector<Bucket> expected_buckets;
+    for (auto [key, count]: reference) {
+        expected_buckets.push_back({.key = key, .count = count});
+    }
+
+    auto sketch = acc.ToSketch();
+    EXPECT_EQ(sketch.buckets, expected_buckets);
+    EXPECT_EQ(sketch.metadata.count, 50);
+}
+
 TEST(Accumulator, Clear) {
-    auto acc = Accumulator{
-            .metadata = Metadata{},
-            .buckets = std::unordered_map<unsigned short, unsigned long long>{{1, 1}},
-    };
+    Accumulator acc;
+    acc.metadata = Metadata{};
+    acc.Add(1, 1);
+    acc.Add(100, 1);
 
     EXPECT_TRUE(acc.metadata.has_value());
-    EXPECT_FALSE(acc.buckets.empty());
+    EXPECT_FALSE(acc.Empty());
     acc.Clear();
     EXPECT_FALSE(acc.metadata.has_value());
-    EXPECT_TRUE(acc.buckets.empty());
-}
\ No newline at end of file
+    EXPECT_TRUE(acc.Empty());
+    EXPECT_TRUE(acc.Buckets().empty());
+
+    // The window is kept for reuse, and zeroed
+    EXPECT_FALSE(acc.counts.empty());
+    acc.Add(50, 2);
+    std::vector<Bucket> expected_buckets = {{50, 2}};
+    EXPECT_EQ(acc.Buckets(), expected_buckets);
+}
+
+TEST(Accumulator, QuantilesSkipEmptyKeys) {
+    Accumulator acc;
+    acc.metadata = Metadata{.version = 1, .sum = 100, .count = 6, .gamma = 1.02};
+    acc.Add(10, 0);
+    acc.Add(20, 1);
+    acc.Add(21, 0);
+    acc.Add(300, 5);
+    acc.Add(400, 0);
+
+    std::vector<double> qs = {0, 0.1, 0.2, 0.5, 1, 2};
+    QuantileQuery query;
+    query.Set(qs.data(), qs.size());
+    acc.Quantiles(query);
+
+    auto sketch = acc.ToSketch();
+    for (size_t i = 0; i < qs.size(); i++) {
+        EXPECT_EQ(query.values[i], sketch.Quantile(qs[i])) << "q = " << qs[i];
+    }
+    EXPECT_EQ(query.last_key, 300);
+}
+
+TEST(Kernels, MatchScalar) {
+    auto &all = Kernels::All();
+    ASSERT_FALSE(all.empty());
+    EXPECT_STREQ(all.front().name, "scalar");
+    EXPECT_STREQ(Kernels::Best().name, all.back().name);
+
+    std::mt19937_64 rng(7);
+    auto &scalar = all.front();
+    for (size_t n: {0, 1, 2, 3, 5, 8, 15, 16, 17, 31, 33, 64, 100, 1000}) {
+        std::vector<unsigned long long> counts(n), other(n);
+        std::vector<Bucket> buckets(n);
+        for (size_t i = 0; i < n; i++) {
+            counts[i] = rng() % 4 == 0 ? 0 : rng() % 1000;
+            other[i] = rng() % (1ULL << 40);
+            buckets[i] = {.key = (unsigned short) rng(), .count = counts[i]};
+        }
+
+        auto expected_sums = counts;
+        scalar.add_counts(expected_sums.data(), other.data(), n);
+        std::vector<unsigned long long> expected_cumulative(n);
+        scalar.cumulative_counts(buckets.data(), n, expected_cumulative.data());
+        unsigned long long total = n ? expected_cumulative.back() : 0;
+
+        for (auto &variant: all) {
+            SCOPED_TRACE(std::string(variant.name) + ", n = " + std::to_string(n));
+
+            auto sums = counts;
+            variant.add_counts(sums.data(), other.data(), n);
+            EXPECT_EQ(sums, expected_sums);
+
+            std::vector<unsigned long long> cumulative(n);
+            variant.cumulative_counts(buckets.data(), n, cumulative.data());
+            EXPECT_EQ(cumulative, expected_cumulative);
+
+            // Every rank, starting from the beginning and from part way in
+            for (unsigned long long rank = 0; rank <= total + 1; rank += 1 + total / 200) {
+                for (size_t start: {(size_t) 0, n / 3}) {
+                    unsigned long long expected_cuml = start ? expected_cumulative[start - 1] : 0;
+                    auto expected_index = start + scalar.find_rank(counts.data() + start, n - start, expected_cuml,
+                                                                   rank);
+
+                    unsigned long long cuml = start ? expected_cumulative[start - 1] : 0;
+                    auto index = start + variant.find_rank(counts.data() + start, n - start, cuml, rank);
+                    EXPECT_EQ(index, expected_index) << "rank = " << rank;
+                    EXPECT_EQ(cuml, expected_cuml) << "rank = " << rank;
+                }
+            }
+        }
+    }
+}
+
+TEST(Stats, Counters) {
+    Sketch sketch = {
+            .metadata = {.version = 1, .sum = 10, .count = 3, .gamma = 1.02},
+            .buckets = {{.key = 100, .count = 1}, {.key = 110, .count = 2}},
+    };
+    auto serialized = sketch.Serialize();
+
+    Stats::Reset();
+    EXPECT_EQ(Stats::Totals()[Stats::SKETCHES_DECODED], 0);
+    EXPECT_EQ(Stats::PeakAccumulatorBytes(), 0);
+
+    Accumulator acc;
+    ASSERT_TRUE(acc.Merge(serialized.data(), serialized.size()));
+    ASSERT_TRUE(acc.Merge(serialized.data(), serialized.size()));
+    EXPECT_FALSE(acc.Merge(serialized.data(), 3));
+
+    // Counts from other threads are included, also after they exit
+    std::thread([&]() {
+        ASSERT_TRUE(Sketch::Deserialize(serialized.data(), serialized.size()));
+    }).join();
+
+    auto totals = Stats::Totals();
+    EXPECT_EQ(totals[Stats::SKETCHES_DECODED], 3);
+    EXPECT_EQ(totals[Stats::BYTES_DECODED], 3 * serialized.size());
+    EXPECT_EQ(totals[Stats::BUCKETS_MERGED], 4);
+    EXPECT_EQ(totals[Stats::DECODE_FAILURES], 1);
+    EXPECT_EQ(Stats::PeakAccumulatorBytes(), acc.counts.size() * sizeof(unsigned long long));
+
+    auto json = Stats::JSON();
+    EXPECT_NE(json.find("\"sketches_decoded\":3,"), std::string::npos) << json;
+    EXPECT_NE(json.find("\"peak_accumulator_bytes\":"), std::string::npos) << json;
+
+    Stats::Reset();
+    EXPECT_EQ(Stats::Totals()[Stats::SKETCHES_DECODED], 0);
+    EXPECT_EQ(Stats::Totals()[Stats::DECODE_FAILURES], 0);
+}
+
+TEST(StreamingMerge, MatchesAccumulator) {
+    std::mt19937_64 rng(21);
+    StreamingMerge merger;
+    std::string out;
+
+    for (int round = 0; round < 200; round++) {
+        std::vector<std::string> serialized;
+        Accumulator acc;
+        for (int i = 0; i < 1 + (int) (rng() % 5); i++) {
+            std::vector<Bucket> buckets;
+            unsigned long long count = 0;
+            unsigned short key = rng() % 100;
+            for (int b = 0; b < 1 + (int) (rng() % 30); b++) {
+                buckets.push_back({.key = key, .count = rng() % 4 == 0 ? 0 : 1 + rng() % 1000});
+                count += buckets.back().count;
+                key += 1 + rng() % 5;
+            }
+            // The first sketch must be version 1, the others can be any version
+            unsigned char version = i == 0 ? 1 : 1 + rng() % 3;
+            Sketch sketch = {.metadata = {.version = version, .sum = (float) count, .count = count + 1,
+                                          .gamma = 1.02},
+                             .buckets = buckets};
+            serialized.push_back(sketch.Serialize());
+            ASSERT_TRUE(acc.Merge(serialized.back().data(), serialized.back().size()) || acc.Empty());
+        }
+        std::vector<std::string_view> sketches(serialized.begin(), serialized.end());
+
+        auto expected = acc.ToSketch();
+        ASSERT_TRUE(merger.Merge(sketches, out)) << round;
+        EXPECT_EQ(out, expected.Serialize()) << round;
+    }
+
+    // With every bucket empty, the first is kept as it is by an Accumulator
+    std::string empty = Sketch{.metadata = {.version = 1, .sum = 0, .count = 1, .gamma = 1.02},
+                               .buckets = {{7, 0}, {9, 0}}}.Serialize();
+    std::string later_empty = Sketch{.metadata = {.version = 1, .sum = 0, .count = 1, .gamma = 1.02},
+                                     .buckets = {{8, 0}}}.Serialize();
+    std::vector<std::string_view> empties = {later_empty, empty};
+    ASSERT_TRUE(merger.Merge(empties, out));
+    std::vector<Bucket> first_empty = {{7, 0}};
+    EXPECT_EQ(Sketch::Deserialize(out.data(), out.size()).value().buckets, first_empty);
+
+    // A repeated key within a sketch (a zero delta) is summed
+    std::string repeated = Sketch{.metadata = {.version = 1, .sum = 3, .count = 3, .gamma = 1.02},
+                                  .buckets = {{5, 1}, {5, 2}}}.Serialize();
+    std::vector<std::string_view> sketches = {repeated, repeated};
+    ASSERT_TRUE(merger.Merge(sketches, out));
+    std::vector<Bucket> expected_buckets = {{5, 6}};
+    EXPECT_EQ(Sketch::Deserialize(out.data(), out.size()).value().buckets, expected_buckets);
+
+    // Invalid, unmergeable and version 2 first sketches aren't merged
+    std::string other_gamma = Sketch{.metadata = {.version = 1, .sum = 3, .count = 3, .gamma = 1.5},
+                                     .buckets = {{5, 1}}}.Serialize();
+    std::string version_2 = Sketch{.metadata = {.version = 2, .sum = 3, .count = 3, .gamma = 1.02},
+                                   .buckets = {{5, 1}}}.Serialize();
+    for (std::vector<std::string_view> invalid: std::vector<std::vector<std::string_view>>{
+            {repeated, std::string_view(repeated.data(), 10)},
+            {repeated, other_gamma},
+            {version_2, repeated},
+            {},
+    }) {
+        EXPECT_FALSE(merger.Merge(invalid, out));
+    }
+}
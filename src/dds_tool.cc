@@ -0,0 +1,681 @@
+/*
+ * Offline tool for files of sketches, so that backfills and format migrations
+ * can run on a batch box instead of inside mysqld. Input files are memory
+ * mapped and read record by record; sketches in binary files are decoded
+ * straight from the mapping without being copied.
+ *
+ * Two file formats are supported, each a sequence of records with an optional
+ * key (e.g. the group a sketch belongs to) and a sketch:
+ *
+ * - binary: uint32 key length, key, uint32 sketch length, sketch (little
+ *   endian lengths)
+ * - tsv: lines of tab separated fields where the last field is the hex encoded
+ *   sketch and everything before it is the key, as written by
+ *   `select grp, hex(sketch) into outfile ...`. Lines whose sketch is NULL
+ *   (\N) are skipped. Written files can be loaded back with
+ *   `load data infile ... (grp, @sketch) set sketch = unhex(@sketch)`.
+ *
+ * The generate command writes random sketches in the same formats, as
+ * benchmark data (see script/benchmark).
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "dds.h"
+
+static const char *USAGE =
+        "usage: dds-tool [options] COMMAND ARGS...\n"
+        "\n"
+        "commands:\n"
+        "  merge INPUT OUTPUT              merge sketches with the same key, in order of first appearance\n"
+        "  quantile QUANTILES INPUT        print the key and a JSON array of the comma separated quantiles\n"
+        "                                  of each sketch\n"
+        "  validate INPUT                  print the record number and key of each invalid sketch\n"
+        "  convert VERSION INPUT OUTPUT    re-encode every sketch in the given format version\n"
+        "  generate COUNT OUTPUT           write COUNT random sketches, keyed by group number\n"
+        "\n"
+        "options:\n"
+        "  --input-format=binary|tsv       default: tsv for .tsv and .txt files, binary otherwise\n"
+        "  --output-format=binary|tsv      default: the input format\n"
+        "  --all                           merge: merge every sketch into a single sketch, ignoring keys\n"
+        "  --threads=N                     merge --all and generate: worker threads (default: one per core)\n"
+        "\n"
+        "generate options:\n"
+        "  --groups=N                      number of groups, sketch i is in group i % N (default: COUNT / 1000)\n"
+        "  --values=MIN[-MAX]              values per sketch, uniformly distributed (default: 50)\n"
+        "  --distribution=NAME             of the values, one of uniform (1 to 1000000), lognormal\n"
+        "                                  (median 20), heavy-tail (lognormal with a 1% pareto tail from\n"
+        "                                  200) or bimodal (80% around 2, 20% around 500), default lognormal\n"
+        "  --alphas=A[,B...]               alpha of the sketches of group g is alphas[g % count] (default: 0.01),\n"
+        "                                  values past the largest key of a small alpha go in the last bucket\n"
+        "  --version=N                     binary format version (default: 1)\n"
+        "  --seed=N                        (default: 1)\n";
+
+enum class Format {
+    Binary, Tsv
+};
+
+static std::optional<Format> ParseFormat(std::string_view name) {
+    if (name == "binary") return Format::Binary;
+    if (name == "tsv") return Format::Tsv;
+    return {};
+}
+
+static Format GuessFormat(std::string_view path) {
+    for (std::string_view ext: {".tsv", ".txt"}) {
+        if (path.size() >= ext.size() && path.substr(path.size() - ext.size()) == ext) {
+            return Format::Tsv;
+        }
+    }
+    return Format::Binary;
+}
+
+// Read only mapping of a whole file
+struct MappedFile {
+    void *mapping = nullptr;
+    const char *data = nullptr;
+    size_t length = 0;
+
+    MappedFile() = default;
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (mapping) munmap(mapping, length);
+    }
+
+    bool Open(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+
+        // mmap doesn't accept empty mappings, an empty file has no records
+        if (st.st_size > 0) {
+            mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+                close(fd);
+                return false;
+            }
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+            data = static_cast<const char *>(mapping);
+            length = st.st_size;
+        }
+
+        close(fd);
+        return true;
+    }
+};
+
+struct Record {
+    std::string_view key;
+    std::string_view sketch;
+};
+
+/*
+ * Reads records one at a time. Binary sketches point into the mapped file;
+ * hex sketches are decoded into a buffer that is reused for every record, so
+ * a record is only valid until the next call to #Next.
+ */
+struct RecordReader {
+    Format format;
+    const char *data;
+    const char *end;
+    std::string buffer;
+    size_t number = 0; // of the last record read (or the malformed one), from 1
+    bool error = false;
+
+    RecordReader(Format in_format, const MappedFile &file) :
+            format(in_format), data(file.data), end(file.data + file.length) {}
+
+    // Returns false at the end of the file or on a malformed record (error)
+    bool Next(Record &record) {
+        if (format == Format::Binary) {
+            return NextBinary(record);
+        }
+
+        while (data < end) {
+            if (NextTsv(record)) return true;
+            if (error) return false;
+        }
+        return false;
+    }
+
+    std::optional<std::string_view> ReadLengthPrefixed() {
+        uint32_t length;
+        if (end - data < (long) sizeof(length)) return {};
+        memcpy(&length, data, sizeof(length));
+        data += sizeof(length);
+
+        if ((size_t) (end - data) < length) return {};
+        data += length;
+        return std::string_view(data - length, length);
+    }
+
+    bool NextBinary(Record &record) {
+        if (data >= end) return false;
+
+        number++;
+        auto key = ReadLengthPrefixed();
+        auto sketch = key ? ReadLengthPrefixed() : std::nullopt;
+        if (!sketch) {
+            error = true;
+            return false;
+        }
+
+        record = {.key = key.value(), .sketch = sketch.value()};
+        return true;
+    }
+
+    // Reads the next line, returning false for lines without a sketch
+    bool NextTsv(Record &record) {
+        auto *newline = static_cast<const char *>(memchr(data, '\n', end - data));
+        std::string_view line(data, (newline ? newline : end) - data);
+        data = newline ? newline + 1 : end;
+
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty()) return false;
+
+        number++;
+        auto tab = line.rfind('\t');
+        std::string_view key = tab == std::string_view::npos ? std::string_view() : line.substr(0, tab);
+        std::string_view hex = tab == std::string_view::npos ? line : line.substr(tab + 1);
+        if (hex == "\\N") return false;
+
+        if (hex.size() % 2) {
+            error = true;
+            return false;
+        }
+        buffer.resize(hex.size() / 2);
+        for (size_t i = 0; i < buffer.size(); i++) {
+            int high = HexDigit(hex[2 * i]);
+            int low = HexDigit(hex[2 * i + 1]);
+            if (high < 0 || low < 0) {
+                error = true;
+                return false;
+            }
+            buffer[i] = (char) (high << 4 | low);
+        }
+
+        record = {.key = key, .sketch = buffer};
+        return true;
+    }
+
+    static int HexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+};
+
+/*
+ * Writes records to a buffer, which is written to out (if set) whenever it
+ * gets large and by #Flush. Without out, the caller takes the buffer.
+ */
+struct RecordWriter {
+    Format format;
+    FILE *out = nullptr;
+    std::string buffer;
+
+    void Write(std::string_view key, std::string_view sketch) {
+        if (format == Format::Binary) {
+            WriteLengthPrefixed(key);
+            WriteLengthPrefixed(sketch);
+        } else {
+            if (!key.empty()) {
+                buffer.append(key);
+                buffer.push_back('\t');
+            }
+
+            static const char digits[] = "0123456789ABCDEF";
+            size_t start = buffer.size();
+            buffer.resize(start + sketch.size() * 2);
+            for (size_t i = 0; i < sketch.size(); i++) {
+                buffer[start + 2 * i] = digits[(unsigned char) sketch[i] >> 4];
+                buffer[start + 2 * i + 1] = digits[(unsigned char) sketch[i] & 0xf];
+            }
+            buffer.push_back('\n');
+        }
+
+        if (out && buffer.size() >= (1 << 20)) Flush();
+    }
+
+    void WriteLengthPrefixed(std::string_view bytes) {
+        auto length = (uint32_t) bytes.size();
+        buffer.append((const char *) &length, sizeof(length));
+        buffer.append(bytes);
+    }
+
+    void Flush() {
+        fwrite(buffer.data(), 1, buffer.size(), out);
+        buffer.clear();
+    }
+};
+
+enum class Distribution {
+    Uniform, Lognormal, HeavyTail, Bimodal
+};
+
+struct Options {
+    std::optional<Format> input_format;
+    std::optional<Format> output_format;
+    bool all = false;
+    unsigned int threads = 0;
+    std::vector<const char *> args;
+
+    // generate
+    std::optional<size_t> groups;
+    size_t min_values = 50;
+    size_t max_values = 50;
+    Distribution distribution = Distribution::Lognormal;
+    std::vector<double> alphas = {0.01};
+    unsigned char version = 1;
+    uint64_t seed = 1;
+};
+
+static int Fail(const char *message, const char *detail = "") {
+    fprintf(stderr, "dds-tool: %s%s\n", message, detail);
+    return 1;
+}
+
+// Parses a comma separated list of numbers
+static std::optional<std::vector<double>> ParseList(const char *list) {
+    std::vector<double> values;
+    for (const char *p = list; *p;) {
+        char *next;
+        values.push_back(strtod(p, &next));
+        if (next == p || (*next != ',' && *next != '\0')) return {};
+        p = *next ? next + 1 : next;
+    }
+    return values;
+}
+
+static int ReadError(const RecordReader &reader) {
+    fprintf(stderr, "dds-tool: malformed record %zu\n", reader.number);
+    return 1;
+}
+
+static int Merge(const Options &options, RecordReader &reader, RecordWriter &writer) {
+    Record record;
+
+    if (options.all) {
+        // Binary sketches are merged straight from the mapping, hex ones
+        // have to be kept decoded until the merge
+        std::vector<std::string> decoded;
+        std::vector<std::string_view> sketches;
+        while (reader.Next(record)) {
+            if (reader.format == Format::Tsv) {
+                decoded.emplace_back(record.sketch);
+            } else {
+                sketches.push_back(record.sketch);
+            }
+        }
+        if (reader.error) return ReadError(reader);
+        sketches.insert(sketches.end(), decoded.begin(), decoded.end());
+
+        Accumulator acc;
+        if (!acc.MergeMany(sketches, options.threads)) return Fail("invalid or unmergeable sketch");
+        if (acc.Empty()) return 0;
+
+        std::string out(acc.SerializedSize(), '\0');
+        acc.SerializeTo(out.data());
+        writer.Write({}, out);
+        return 0;
+    }
+
+    // Keys point into the mapped file, so they can be used without a copy
+    std::unordered_map<std::string_view, size_t> index;
+    std::vector<std::pair<std::string_view, Accumulator>> groups;
+    while (reader.Next(record)) {
+        auto [it, inserted] = index.emplace(record.key, groups.size());
+        if (inserted) groups.emplace_back(record.key, Accumulator());
+
+        if (!groups[it->second].second.Merge(record.sketch.data(), record.sketch.size())) {
+            fprintf(stderr, "dds-tool: invalid or unmergeable sketch in record %zu\n", reader.number);
+            return 1;
+        }
+    }
+    if (reader.error) return ReadError(reader);
+
+    std::string out;
+    for (auto &[key, acc]: groups) {
+        out.resize(acc.SerializedSize());
+        acc.SerializeTo(out.data());
+        writer.Write(key, out);
+    }
+    return 0;
+}
+
+static int Quantile(const char *quantiles, RecordReader &reader) {
+    QuantileQuery query;
+    auto qs = ParseList(quantiles);
+    if (!qs) return Fail("invalid quantiles: ", quantiles);
+    query.qs = qs.value();
+    query.Sort();
+
+    Record record;
+    while (reader.Next(record)) {
+        auto view = SketchView::Deserialize(record.sketch.data(), record.sketch.size());
+        bool valid = view && view.value().Quantiles(query);
+
+        if (!record.key.empty()) {
+            fwrite(record.key.data(), 1, record.key.size(), stdout);
+            fputc('\t', stdout);
+        }
+        fputs(valid ? query.JSON().c_str() : "NULL", stdout);
+        fputc('\n', stdout);
+    }
+    return reader.error ? ReadError(reader) : 0;
+}
+
+static int Validate(RecordReader &reader) {
+    size_t invalid = 0;
+    Record record;
+    while (reader.Next(record)) {
+        auto view = SketchView::Deserialize(record.sketch.data(), record.sketch.size());
+        if (!view || !view.value().Valid()) {
+            printf("%zu\t%.*s\n", reader.number, (int) record.key.size(), record.key.data());
+            invalid++;
+        }
+    }
+    if (reader.error) return ReadError(reader);
+
+    fprintf(stderr, "%zu records, %zu invalid\n", reader.number, invalid);
+    return invalid ? 1 : 0;
+}
+
+static int Convert(const char *version_arg, RecordReader &reader, RecordWriter &writer) {
+    char *end;
+    long version = strtol(version_arg, &end, 10);
+    if (*end != '\0' || version < 1 || version > 3) return Fail("unknown version: ", version_arg);
+
+    // One accumulator re-encodes every record, reusing its window
+    Accumulator acc;
+    std::string out;
+    Record record;
+    while (reader.Next(record)) {
+        acc.Clear();
+        if (!acc.Merge(record.sketch.data(), record.sketch.size())) {
+            fprintf(stderr, "dds-tool: invalid sketch in record %zu\n", reader.number);
+            return 1;
+        }
+        acc.metadata.value().version = (unsigned char) version;
+
+        out.resize(acc.SerializedSize());
+        acc.SerializeTo(out.data());
+        writer.Write(record.key, out);
+    }
+    return reader.error ? ReadError(reader) : 0;
+}
+
+// Small, quickly seeded random number generator, so every sketch can have
+// its own seed and the output doesn't depend on the number of threads
+struct SplitMix64 {
+    using result_type = uint64_t;
+    uint64_t state;
+
+    static constexpr uint64_t min() {
+        return 0;
+    }
+
+    static constexpr uint64_t max() {
+        return UINT64_MAX;
+    }
+
+    uint64_t operator()() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+};
+
+// Generates sketches [begin, end) into writer. Each thread has its own
+// generator, for its own key mappers.
+struct SketchGenerator {
+    const Options &options;
+    size_t groups;
+    std::vector<KeyMapper> mappers; // one per alpha
+    Accumulator acc;
+    std::string out;
+
+    SketchGenerator(const Options &in_options, size_t in_groups) : options(in_options), groups(in_groups) {
+        for (auto alpha: options.alphas) {
+            mappers.emplace_back(KeyMapper::Gamma(alpha));
+        }
+    }
+
+    double Value(SplitMix64 &rng) const {
+        std::normal_distribution<double> normal;
+        std::uniform_real_distribution<double> uniform;
+
+        switch (options.distribution) {
+            case Distribution::Uniform:
+                return (double) (1 + rng() % 1000000);
+            case Distribution::Lognormal:
+                return 20 * exp(normal(rng));
+            case Distribution::HeavyTail:
+                if (rng() % 100 == 0) {
+                    return std::min(200 * pow(1 - uniform(rng), -1 / 1.5), 1e12);
+                }
+                return 20 * exp(0.5 * normal(rng));
+            case Distribution::Bimodal:
+                return rng() % 10 < 8 ? 2 * exp(0.5 * normal(rng)) : 500 * exp(0.3 * normal(rng));
+        }
+        return 0;
+    }
+
+    void Generate(size_t begin, size_t end, RecordWriter &writer) {
+        for (size_t i = begin; i < end; i++) {
+            SplitMix64 rng{options.seed * 0x100000001b3ULL + i};
+            size_t group = i % groups;
+            auto &mapper = mappers[group % mappers.size()];
+
+            size_t values = options.min_values + rng() % (options.max_values - options.min_values + 1);
+            double sum = 0;
+            acc.Clear();
+            for (size_t v = 0; v < values; v++) {
+                double value = Value(rng);
+                // Values past the largest key (with a small alpha) go in
+                // the last bucket, as dds_rank treats them
+                acc.Add(mapper.Key(value).value_or(USHRT_MAX), 1);
+                sum += value;
+            }
+            acc.metadata = Metadata{
+                    .version = options.version,
+                    .sum = (float) sum,
+                    .count = values,
+                    .gamma = (float) mapper.gamma,
+            };
+
+            char key[24];
+            auto key_end = std::to_chars(key, key + sizeof(key), group).ptr;
+
+            out.resize(acc.SerializedSize());
+            acc.SerializeTo(out.data());
+            writer.Write({key, (size_t) (key_end - key)}, out);
+        }
+    }
+};
+
+// Sketches generated by all threads before their output is written in order
+static const size_t GENERATE_BATCH_SIZE = 1 << 16;
+
+static int Generate(const Options &options, const char *count_arg, RecordWriter &writer) {
+    char *end;
+    size_t count = strtoull(count_arg, &end, 10);
+    if (*end != '\0') return Fail("invalid count: ", count_arg);
+
+    size_t groups = std::max<size_t>(1, options.groups.value_or(count / 1000));
+    unsigned int threads = options.threads ? options.threads : std::max(1U, std::thread::hardware_concurrency());
+
+    std::vector<SketchGenerator> generators;
+    std::vector<RecordWriter> buffers;
+    for (unsigned int t = 0; t < threads; t++) {
+        generators.emplace_back(options, groups);
+        buffers.push_back(RecordWriter{.format = writer.format, .out = nullptr, .buffer = {}});
+    }
+
+    for (size_t batch = 0; batch < count; batch += GENERATE_BATCH_SIZE) {
+        size_t batch_end = std::min(count, batch + GENERATE_BATCH_SIZE);
+
+        std::vector<std::thread> pool;
+        for (unsigned int t = 0; t < threads; t++) {
+            pool.emplace_back([&, t] {
+                size_t size = batch_end - batch;
+                generators[t].Generate(batch + size * t / threads, batch + size * (t + 1) / threads, buffers[t]);
+            });
+        }
+        for (auto &thread: pool) {
+            thread.join();
+        }
+
+        for (auto &buffer: buffers) {
+            writer.buffer.append(buffer.buffer);
+            writer.Flush();
+            buffer.buffer.clear();
+        }
+    }
+
+    return 0;
+}
+
+static std::optional<Options> ParseOptions(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg.substr(0, 2) != "--") {
+            options.args.push_back(argv[i]);
+        } else if (arg.substr(0, 15) == "--input-format=") {
+            options.input_format = ParseFormat(arg.substr(15));
+            if (!options.input_format) return {};
+        } else if (arg.substr(0, 16) == "--output-format=") {
+            options.output_format = ParseFormat(arg.substr(16));
+            if (!options.output_format) return {};
+        } else if (arg == "--all") {
+            options.all = true;
+        } else if (arg.substr(0, 10) == "--threads=") {
+            options.threads = (unsigned int) strtoul(argv[i] + 10, nullptr, 10);
+        } else if (arg.substr(0, 9) == "--groups=") {
+            options.groups = strtoull(argv[i] + 9, nullptr, 10);
+        } else if (arg.substr(0, 9) == "--values=") {
+            char *end;
+            options.min_values = options.max_values = strtoull(argv[i] + 9, &end, 10);
+            if (*end == '-') options.max_values = strtoull(end + 1, &end, 10);
+            if (*end != '\0' || options.min_values == 0 || options.max_values < options.min_values) return {};
+        } else if (arg.substr(0, 15) == "--distribution=") {
+            auto name = arg.substr(15);
+            if (name == "uniform") {
+                options.distribution = Distribution::Uniform;
+            } else if (name == "lognormal") {
+                options.distribution = Distribution::Lognormal;
+            } else if (name == "heavy-tail") {
+                options.distribution = Distribution::HeavyTail;
+            } else if (name == "bimodal") {
+                options.distribution = Distribution::Bimodal;
+            } else {
+                return {};
+            }
+        } else if (arg.substr(0, 9) == "--alphas=") {
+            auto alphas = ParseList(argv[i] + 9);
+            if (!alphas || alphas.value().empty()) return {};
+            for (auto alpha: alphas.value()) {
+                if (!(alpha > 0 && alpha < 1)) return {};
+            }
+            options.alphas = alphas.value();
+        } else if (arg.substr(0, 10) == "--version=") {
+            auto version = strtoul(argv[i] + 10, nullptr, 10);
+            if (version < 1 || version > 3) return {};
+            options.version = (unsigned char) version;
+        } else if (arg.substr(0, 7) == "--seed=") {
+            options.seed = strtoull(argv[i] + 7, nullptr, 10);
+        } else {
+            return {};
+        }
+    }
+    return options;
+}
+
+int main(int argc, char **argv) {
+    auto options = ParseOptions(argc, argv);
+    if (!options || options.value().args.empty()) {
+        fputs(USAGE, stderr);
+        return 2;
+    }
+
+    auto &args = options.value().args;
+    std::string_view command = args[0];
+
+    // Number of arguments after the command, the input is always the first
+    // path and the output (if any) the second
+    size_t arg_count = command == "merge" ? 2 : command == "quantile" ? 2 : command == "validate" ? 1 :
+                                                                           command == "convert" ? 3 :
+                                                                           command == "generate" ? 2 : 0;
+    if (arg_count == 0 || args.size() != arg_count + 1) {
+        fputs(USAGE, stderr);
+        return 2;
+    }
+
+    if (command == "generate") {
+        FILE *out = fopen(args[2], "wb");
+        if (!out) return Fail("can't write ", args[2]);
+
+        auto format = options.value().output_format.value_or(GuessFormat(args[2]));
+        RecordWriter writer{.format = format, .out = out, .buffer = {}};
+        int status = Generate(options.value(), args[1], writer);
+        writer.Flush();
+
+        if (fclose(out) != 0 && status == 0) {
+            return Fail("can't write ", args[2]);
+        }
+        return status;
+    }
+
+    bool takes_value = command == "quantile" || command == "convert";
+    const char *input = args[takes_value ? 2 : 1];
+    const char *output = command == "merge" ? args[2] : command == "convert" ? args[3] : nullptr;
+
+    MappedFile file;
+    if (!file.Open(input)) return Fail("can't read ", input);
+
+    auto input_format = options.value().input_format.value_or(GuessFormat(input));
+    RecordReader reader(input_format, file);
+
+    if (command == "quantile") return Quantile(args[1], reader);
+    if (command == "validate") return Validate(reader);
+
+    FILE *out = fopen(output, "wb");
+    if (!out) return Fail("can't write ", output);
+
+    RecordWriter writer{.format = options.value().output_format.value_or(input_format), .out = out, .buffer = {}};
+    int status = command == "merge" ? Merge(options.value(), reader, writer) : Convert(args[1], reader, writer);
+    writer.Flush();
+
+    if (fclose(out) != 0 && status == 0) {
+        return Fail("can't write ", output);
+    }
+    return status;
+}